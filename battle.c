@@ -7,72 +7,216 @@
  * _or_ for a new connection.
 */
 
+#ifdef __linux__
+    #define _GNU_SOURCE //accept4
+#endif
+
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "protocol.h"
+#include "journal.h"
+#include "engine.h"
+#include "handoff.h"
+
+#ifdef __linux__
+    #include <sys/epoll.h>
+    #define HAVE_EPOLL 1
+    #define HAVE_ACCEPT4 1
+#endif
 
 #ifndef PORT
     #define PORT 30100
 #endif
 
 #define TIMEOUT_SECONDS 10
+#define TURN_TIMEOUT 60 //default seconds a player has for a move (0 for no limit)
+#define REGISTER_TIMEOUT 60 //default seconds a new connection has to send its name (0 for no limit)
+#define IDLE_TIMEOUT 600 //default seconds a registered player outside a match may go without sending anything (0 for no limit)
 #define MAX_NAME_LEN 50
 #define MAX_MSG_LEN 200
-#define MAX_BUFFER_LEN 200
-
-#define HP_MIN 20
-#define HP_MAX 30
-
-#define REGULAR_DMG_MIN 2
-#define REGULAR_DMG_MAX 6
-
-#define POWERMOVE_COUNT_MIN 1
-#define POWERMOVE_COUNT_MAX 3
-#define POWERMOVE_DMG_MULTIPLIER 3 //powermove is just regular dmg (generated randomly) multiplied by the multiplier
-#define POWERMOVE_CHANCE 2 //2 means chance of powermove is 1/2, or 50%. If it was 3, it would be 1/3, or 33%, and so on...
-
-#define HP_REGEN_MIN 3 //min amount of regeneration
-#define HP_REGEN_MAX 10 //max amount of regeneration
-#define HP_REGEN_COUNT_MIN 1
-#define HP_REGEN_COUNT_MAX 3
+#define MAX_BUFFER_LEN 200 //longest name or chat line, including the NUL terminator
+#define INPUT_RING_LEN 1024 //per-client input ring size, must be a power of two and larger than MAX_BUFFER_LEN
+#define MAX_EVENTS 256 //max readiness events handled per reactor_wait() call
+#define LISTEN_BACKLOG 1024 //default listen() backlog, so a burst of reconnects waits in the kernel instead of being refused
+#define ACCEPT_BATCH 256 //most connections accepted per wakeup, so a storm can't starve clients that are already connected
+#define MAX_IOV 64 //max output chunks written per writev() call
+#define NAME_INDEX_MIN_SLOTS 64 //initial size of the name index, must be a power of two
+#define MAX_WORKERS 64
+#define POOL_SLAB_OBJECTS 64 //objects carved out of each slab a pool mallocs
+#define MSGBUF_SMALL_LEN 512 //messages up to this many bytes come from msgbuf_pool, longer ones from malloc
+#define MAX_FRAME_LEN 512 //longest frame composed for one player (see struct frame)
+#define POOL_COUNT 6 //pools each worker has (see printpoolstats)
+#define TIMER_TICK_MS 100 //timer wheel resolution
+#define TIMER_BITS 6 //each wheel level has 2^TIMER_BITS slots
+#define TIMER_LEVELS 4 //so the wheel reaches 2^24 ticks (~19 days) ahead, later deadlines are clamped
+#define JOURNAL_BUF_LEN (64 * 1024) //journal records are staged per worker in buffers this big
+#define JOURNAL_MAX_QUEUED 64 //full buffers waiting for the journal writer before new ones are dropped
+#define JOURNAL_FLUSH_MS 200 //longest a partly filled journal buffer waits before going to the writer
+#define PROFILE_MAGIC "BTLPROF1" //first bytes of a profile store (--profiles)
+#define PROFILE_MAGIC_LEN 8
+#define PROFILE_FLUSH_MS 500 //profile changes collect this long before the profile writer writes and syncs them
+#define PROFILE_INDEX_MIN_SLOTS 1024 //initial size of the profile index, must be a power of two
+#define RATING_INITIAL 1500 //Elo rating of a new player
+#define RATING_K 16 //most a match can move an established player's rating
+#define RATING_K_PROVISIONAL 32 //the same for a player's first RATING_PROVISIONAL_MATCHES matches, so they settle quickly
+#define RATING_PROVISIONAL_MATCHES 20
+#define RATING_BUCKET_WIDTH 16 //waiting clients are indexed by rating in buckets this wide
+#define RATING_BUCKETS 256 //so the index covers ratings 0 to 4095, anything outside goes in the first or last bucket
+#define RATING_WINDOW 100 //how far apart two players' ratings may be when one of them has just started waiting
+#define RATING_WINDOW_GROWTH 50 //how much that grows for every second of waiting
+#define MATCHMAKING_RETRY_MS 1000 //how often clients that are still waiting look again, with their wider windows
+#define MAX_LISTED_MATCHES 20 //live matches shown to a client that asks for the list
+#define LOG_RING_SLOTS 1024 //log lines a worker can have waiting for the log writer, must be a power of two
+#define LOG_LINE_LEN 240 //longest log line, longer ones are cut short
+#define LOG_FLUSH_MS 50 //how often the log writer looks for new lines
+#define LOG_RATE 1000 //default lines per second each worker may log. the rest are dropped and counted
+#define HIST_BUCKETS 40 //latency histogram buckets, the last one takes everything from 2^39ns (~9 minutes) up
+
+//log levels (--log-level). a line is logged when its level is at most the log level
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4 //every read. compiled in, but off unless asked for
+
+//logs a line (no newline needed) at level. the arguments are only evaluated if the level is on, so a trace line
+//on a hot path costs one compare while tracing is off
+#define LOG(level, ...) do { if ((level) <= log_level) logline((level), __VA_ARGS__); } while (0)
+
+//counters that only their own worker writes, but that any worker may read for a stats dump. a plain load and
+//a relaxed store keep that race-free without paying for an atomic read-modify-write on every update
+#define STAT_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+#define STAT_SET(var, v) __atomic_store_n(&(var), (v), __ATOMIC_RELAXED)
+#define STAT_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+//why the workers are stopping (see server_shutting_down)
+#define SHUTDOWN_EMPTY 1 //nobody has been connected for TIMEOUT_SECONDS
+#define SHUTDOWN_HANDOFF 2 //a new server is taking over (--handoff)
+
+#define OUTQ_SOFT_LIMIT (64 * 1024) //default: stop reading from a client whose queued output is over this many bytes
+#define OUTQ_HARD_LIMIT (1024 * 1024) //default: disconnect a client whose queued output is over this many bytes
+
+//a timer on the worker's timer wheel (see timer_arm). embedded in whatever it times, so arming never allocates
+struct timer {
+    struct timer *next; //slot list links. next is NULL exactly when the timer is not armed
+    struct timer *prev;
+    unsigned long expires; //tick
+    void (*fire)(void *owner);
+    void *owner;
+};
 
+//a connection. what the event loop touches on every read and write comes first, the rest after it. buffers only
+//exist while data is pending and the name is the name index's copy, so an idle client is just this struct
+//(see the memory budget in README)
 struct client {
     int fd;
-    struct in_addr ipaddr;
-    struct client *next;
+    unsigned int name_registered : 1;
+    unsigned int binary : 1; //1 once the client has switched to the binary protocol (see protocol.h)
+    unsigned int in_match : 1;
+    unsigned int waiting : 1; //1 while registered, not in a match, and queued for an opponent
+    unsigned int buffering_input : 1; //1 while a name or chat line is being read, 0 while reading single-byte commands
+    unsigned int discarding : 1; //1 while skipping the rest of a line that was longer than MAX_BUFFER_LEN
+    unsigned int want_write : 1; //1 while the socket is full and we are waiting for it to become writable
+    unsigned int throttled : 1; //1 while input is not read because the output queue is over the soft limit
+    unsigned int closing : 1; //1 once the client has been marked for removal (see markclosing)
+    unsigned int flush_pending : 1; //1 while on the flush list
+    unsigned int watch_prompt : 1; //1 while reading the name of a player whose match c wants to watch
+    unsigned int interest : 4; //reactor events currently registered for fd
+
+    struct bufferinfo *bufferinfo; //input not handled yet, NULL when there is none
+
+    //output queue, flushed with writev() whenever the socket is writable
+    struct outchunk *outq_head;
+    struct outchunk *outq_tail;
+    size_t outq_bytes;
+
+    struct client *flush_next;
+    struct client *close_next;
+
+    //matchmaking queue and rating bucket links, only valid while waiting is 1
+    struct client *wait_next;
+    struct client *wait_prev;
+    struct client *bucket_next;
+    struct client *bucket_prev;
 
-    int name_registered; //0 for false, 1 for true
-    char name[MAX_NAME_LEN];
+    struct client *next;
+    struct client *prev; //doubly linked so clients can be unlinked in O(1)
 
+    const char *name; //the name index's copy once registered, "" before
     struct player_info *player_info;
-
-    int in_match; //0 for false, 1 for true
     struct match *current_match;
+    struct client *client_just_played; //always mutual: if a->client_just_played is b, then b->client_just_played is a
+
+    unsigned long wait_since; //when c joined the matchmaking queue (see nowns)
+    int rating; //Elo, RATING_INITIAL for a new player
+    unsigned int rated_matches;
+
+    struct profile *profile; //c's stored profile (--profiles), NULL until it has one
+
+    //the match c is spectating (which takes it out of the matchmaking queue), or NULL, and the links in its spectator list
+    struct match *watching;
+    struct client *spec_next;
+    struct client *spec_prev;
+    struct in_addr ipaddr;
+    unsigned int last_input; //tick of the last read from c
 
-    struct client *client_just_played;
+    struct timer deadline; //registration deadline until c has a name, idle timeout after that
+};
+
+//an encoded message. a broadcast is encoded once and the same msgbuf goes on every recipient's output queue
+struct msgbuf {
+    int refs; //one per output queue entry, plus one for whoever is still building/sending it
+    int pooled; //1 if it came from msgbuf_pool
+    size_t len;
+    size_t cap; //room in data. a msgbuf only one queue refers to may grow up to this (see queueoutput)
+    char data[];
+};
 
-    struct bufferinfo *bufferinfo;
+//everything one game event shows one player, composed here and queued as a single message
+struct frame {
+    size_t len;
+    char data[MAX_FRAME_LEN];
 };
 
-struct player_info {
-    int hp; //healthpoints
-    int powermoves_remaining;
-    int hp_regens_remaining;
+//an entry in a client's output queue, freed once its message has been written completely
+struct outchunk {
+    struct outchunk *next;
+    struct msgbuf *msg;
+    size_t off; //bytes of msg already written
 };
 
+//per-client input ring buffer. bytes between head and tail have been read but not handled yet.
+//only allocated while a read is in progress or bytes are left over (e.g. half a line)
 struct bufferinfo {
-    int buffering_input;
-    int buffer_index;
-    char buffer[MAX_BUFFER_LEN];
+    unsigned int head; //index of the next byte to handle (free-running, masked on access)
+    unsigned int tail; //index of the next free byte (free-running, masked on access)
+    char ring[INPUT_RING_LEN];
 };
 
-//malloc matches to free them later on
+//matches come from match_pool and go back to it in endmatch
 struct match {
     struct client* players[2];
     struct client* starting_player;
@@ -84,6 +228,173 @@ struct match {
     int hp_regen_count;
     struct client* winner;
     struct client* loser;
+    struct timer turn_timer; //runs out when the active player takes too long
+    uint64_t seed; //replaying the same moves with this seed replays the match exactly
+    struct rng rng; //every random outcome in the match comes from here
+
+    //spectators, and the match's stream: everything they haven't been sent yet, encoded once per protocol.
+    //the streams go out at the end of the event loop iteration, one shared message per spectator (see flushstream)
+    struct client *spectators;
+    int text_spectators;
+    int binary_spectators;
+    struct msgbuf *stream_text; //NULL when there is nothing to send
+    struct msgbuf *stream_binary;
+    struct match *stream_next; //the worker's list of matches with something in their streams
+    struct match *stream_prev;
+    struct match *next; //the worker's list of live matches, newest first (see linkmatch)
+    struct match *prev;
+};
+
+//fixed-size object pool. objects are carved out of malloced slabs and recycled through a free list,
+//so steady-state connect/disconnect and match churn never reaches malloc
+struct pool {
+    const char *name;
+    size_t objsize;
+    void *free_list; //free objects, linked through their first word
+    void *slabs; //every slab this pool malloced, linked through their first word
+
+    //counters (see printpoolstats)
+    unsigned long slab_count;
+    unsigned long in_use;
+    unsigned long peak;
+    unsigned long allocs;
+    unsigned long frees;
+};
+
+//latency histogram. bucket i counts samples of [2^i, 2^(i+1)) nanoseconds
+struct histogram {
+    unsigned long count;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+//a worker's counters, read by printstats(). everything is updated with STAT_ADD/STAT_SET
+struct metrics {
+    unsigned long accepts;
+    unsigned long rejected; //connections turned away: the server was full (--max-clients) or out of file descriptors
+    unsigned long disconnects;
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    unsigned long syscalls; //socket and reactor calls made for clients
+    unsigned long commands; //commands, names and chat lines handled
+    unsigned long matches_started;
+    unsigned long matches_ended;
+    unsigned long turn_timeouts;
+    unsigned long evictions; //connections dropped for not registering in time, or for idling
+    unsigned long journal_records;
+    unsigned long journal_dropped; //records lost because the journal writer fell too far behind
+    unsigned long log_dropped; //log lines lost to the rate limit or to a full log ring
+    unsigned long clients; //connected right now
+    unsigned long lobby; //waiting for an opponent right now
+
+    struct histogram matchmaking; //from joining the matchmaking queue to being matched
+    struct histogram handleclient_time;
+    struct histogram matchloneclients_time;
+    struct histogram broadcast_all_time;
+};
+
+//a batch of journal records (see journal.h). filled by one worker, then written out by the journal thread
+struct journal_buf {
+    struct journal_buf *next;
+    size_t len;
+    unsigned long records;
+    char data[JOURNAL_BUF_LEN];
+};
+
+//a line waiting for the log writer
+struct log_slot {
+    unsigned long time_ns; //wall clock
+    int level;
+    int len;
+    char text[LOG_LINE_LEN];
+};
+
+//a worker's log lines on their way to the log writer. the worker only moves head and the log writer only moves tail,
+//so neither ever waits for the other: a full ring just drops the line
+struct log_ring {
+    unsigned long head; //next slot the worker fills (free-running, masked on access)
+    char pad[64 - sizeof(unsigned long)]; //keep head and tail on different cache lines
+    unsigned long tail; //next slot the log writer prints
+    struct log_slot slots[LOG_RING_SLOTS];
+};
+
+//a player's profile as the profile store (--profiles) holds it. The store is PROFILE_MAGIC followed by these, appended
+//whenever profiles change, so the last record with a name is that player's profile. It is compacted at startup
+struct profile_record {
+    char name[MAX_NAME_LEN]; //NUL-terminated
+    char pad[2];
+    int32_t rating;
+    uint32_t wins;
+    uint32_t losses;
+    uint64_t last_seen; //seconds since the epoch
+};
+
+//a profile in memory. profiles are never freed, so clients on any worker (and the profile writer) can point at them
+struct profile {
+    struct profile_record rec; //protected by profile_lock, like everything here
+    struct profile *dirty_next;
+    int dirty; //1 while changed since the profile writer last wrote it out, and on the dirty list
+};
+
+//a slot in the profile index. profile is NULL for empty slots
+struct profile_slot {
+    unsigned int hash;
+    struct profile *profile;
+};
+
+//a slot in the name index. name is NULL for empty slots
+struct name_slot {
+    unsigned int hash;
+    char *name; //the index's own copy, so it never depends on a client that may be on another worker
+};
+
+//a worker: one thread with its own listening socket, event loop, clients and matches
+struct shard {
+    int id;
+    pthread_t thread;
+    int listenfd;
+    int wakefd[2]; //pipe written to wake the worker's event loop when mail arrives
+    struct metrics metrics;
+    struct log_ring *log;
+
+    pthread_mutex_t lock; //protects everything below
+    struct mail *mail_head;
+    struct mail *mail_tail;
+    int woken; //1 while a wakeup byte is in the pipe
+    struct pool **pools; //the worker's pools (which live in its thread-local storage), NULL once it has exited
+
+    //hot restart: the worker's handoff records (see handoff.h) and the descriptors they take. the old server's workers
+    //fill these on their way out, and the new server's workers pick up from them when they start
+    char *handoff_data;
+    size_t handoff_len;
+    size_t handoff_cap;
+    int *handoff_fds;
+    int handoff_nfds;
+    int handoff_fds_cap;
+};
+
+//types of mail sent between workers
+#define MAIL_BROADCAST 0 //arena-wide message from another worker's client
+#define MAIL_HANDOFF 1 //a waiting client moving to this worker to find an opponent
+
+struct mail {
+    struct mail *next;
+    int type;
+
+    //MAIL_HANDOFF
+    int fd;
+    struct in_addr ipaddr;
+    const char *name; //the name index's copy, the name stays registered throughout
+    unsigned long wait_since;
+    int binary;
+    int rating;
+    unsigned int rated_matches;
+    struct profile *profile;
+
+    //MAIL_BROADCAST
+    int len;
+    char text[];
 };
 
 struct chat_message {
@@ -93,442 +404,4488 @@ struct chat_message {
     struct chat_message *next;
 };
 
+//reactor backends
+#define REACTOR_EPOLL 0
+#define REACTOR_SELECT 1
+
+//reactor interest/readiness flags
+#define REACTOR_READ 0x1
+#define REACTOR_WRITE 0x2
+#define REACTOR_EDGE 0x4 //edge-triggered, only honoured by the epoll backend
+
+struct reactor_event {
+    int fd;
+    int events; //REACTOR_READ and/or REACTOR_WRITE
+};
+
 
 int bindandlisten();
+void acceptclients(int listenfd);
+void rejectclient(int fd);
+
+int reactor_init(int backend);
+int reactor_add(int fd, int events);
+int reactor_mod(int fd, int events);
+void reactor_del(int fd);
+int reactor_wait(struct reactor_event *events, int max, int timeout_ms);
 
 struct client *addclient(int fd, struct in_addr addr);
 void removeclient(struct client *c);
 void welcomeclient(struct client *c);
 int handleclient(struct client *p);
+void handleinput(struct client *p);
+void handleline(struct client *p, char *line);
+void handlecommand(struct client *p, char cmd);
+void handleframe(struct client *p, unsigned char *frame, unsigned int len);
 int registername(struct client *c, char *s);
 void moveclienttoendoflist(struct client *c);
-
-void resetbuffer(struct client *c);
+void enqueuewaiting(struct client *c);
+void dequeuewaiting(struct client *c);
+void forgetlastopponent(struct client *c);
+void linkclient(struct client *c);
+void unlinkclient(struct client *c);
+struct client *clientbyfd(int fd);
+
+unsigned int hashname(const char *name);
+int nameindex_find(const char *name);
+const char *nameindex_insert(const char *name);
+void nameindex_remove(const char *name);
+
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+void pool_destroy(struct pool *pool);
+void printpoolstats(FILE *out, struct shard *s);
+
+unsigned long nowns();
+void recordtime(struct histogram *h, unsigned long ns);
+void printstats(FILE *out);
+void handleadmin();
+void requeststats(int sig);
+int bindunix(const char *path, const char *what);
+
+void handlehandoff();
+void handoff_append(const void *data, size_t len);
+void handoff_addfd(int fd);
+void handoff_saveclient(struct client *c);
+void handoff_savematch(struct match *match);
+void handoff_save();
+void handoff_send();
+int takeover(const char *path);
+int handoff_claim(struct shard *s);
+void handoff_restore();
+
+void timer_start();
+void timer_init(struct timer *t, void (*fire)(void *owner), void *owner);
+void timer_arm(struct timer *t, unsigned long ms);
+void timer_cancel(struct timer *t);
+void timer_run();
+int timer_wait_ms();
+unsigned long timer_left_ms(struct timer *t);
+void resetdeadline(struct client *c);
+void clientdeadline(void *owner);
+void turntimeout(void *owner);
+
+int journal_open(const char *path);
+void *journalwriter(void *arg);
+void journal_stop();
+void *journal_reserve(struct match *match, int type, int actor, size_t len);
+void journal_submit();
+void journal_flushtimer(void *owner);
+void journal_start(struct match *match);
+void journal_move(struct client *c, int move, int amount);
+void journal_chat(struct client *c, const char *s);
+void journal_timeout(struct match *match);
+void journal_end(struct match *match, int reason);
+
+int profile_open(const char *path);
+void *profilewriter(void *arg);
+void profile_stop();
+struct profile *profile_find(const char *name);
+struct profile *profile_insert(const char *name);
+void profile_touch(struct profile *p);
+void profile_load(struct client *c);
+void profile_save(struct client *c, int won);
+void profile_seen(struct client *c);
+
+void logline(int level, const char *fmt, ...);
+void logprint(FILE *out, unsigned long time_ns, int level, const char *text, int len);
+void *logwriter(void *arg);
+void log_stop();
+
+void *runworker(void *arg);
+void sendmail(struct shard *to, struct mail *m);
+void handlemail();
+void broadcast_arena(struct client *sender, char *s);
+void exchangelonewaiter();
+void handoffclient(struct client *c, int target);
 
 struct match* creatematch(struct client *c1, struct client *c2);
-void endmatch(struct match *match);
+void endmatch(struct match *match, int reason);
+void linkmatch(struct match *match);
+void unlinkmatch(struct match *match);
 int checkifmatchended(struct match *match);
 void switchturn(struct match *match);
 
 struct client* findopponent(struct client *c); //may return NULL if no opponent is available
 void matchloneclients();
+void matchclient(struct client *c);
+void matchmakingretry(void *owner);
+void updateratings(struct match *match);
 
 void attack(struct client *c);
 int usepowermove(struct client *c); //returns 0 if powermove missed, 1 if it landed
 void usehealthregen(struct client *c);
 void speak(struct client *c, char *s); //buffer bytes (bcs using noncanonical mode)
 
-void displayinfo(struct client *c);
-void displaymenu(struct client *c);
+void displayinfo(struct client *c, struct frame *f);
+void displaymenu(struct client *c, struct frame *f);
+void displayplayer(struct client *c, int banner);
 void updatedisplay(struct match *match, int mode);
+void frame_printf(struct frame *f, const char *fmt, ...);
+void sendframe(struct client *c, struct frame *f);
 
 void broadcast_all(struct client *sender, char *s, int size);
 void broadcast_to_client(struct client *c, char *s);
-unsigned int time();
-
-//static variables
-static int *client_count;
-static struct client *top = NULL;
-
+void queuebinary(struct client *c, int type, const void *payload, size_t len);
+void tellclient(struct client *c, int type, const void *payload, size_t len, char *text);
+void tellresult(struct client *c, int result, char *text);
+void tellevent(struct client *c, int event, int by_opponent, int amount, const char *fmt, ...);
+void sendstate(struct client *c);
+
+void lobbycommand(struct client *c, char cmd);
+void backtolobby(struct client *c);
+void listmatches(struct client *c);
+void watchplayer(struct client *c, const char *name);
+void startwatching(struct client *c, struct match *match);
+void linkspectator(struct client *c, struct match *match);
+void stopwatching(struct client *c);
+void spectate(struct match *match, int type, const void *payload, size_t len, const char *fmt, ...);
+void spectatestate(struct match *match, int banner);
+void spectateend(struct match *match, int reason);
+void flushstream(struct match *match);
+void flushstreams();
+void queueoutput(struct client *c, const char *s, size_t len);
+struct msgbuf *msg_new(const char *s, size_t len);
+void msg_release(struct msgbuf *m);
+void queuemsg(struct client *c, struct msgbuf *m);
+void clearoutput(struct client *c);
+int reserveoutput(struct client *c, size_t len);
+int flushclient(struct client *c);
+void flushpending();
+void updateinterest(struct client *c);
+void markclosing(struct client *c);
+void reapclients();
+int setnonblocking(int fd);
+
+//static variables shared by every worker (only written before the workers start, or under a lock)
+static int worker_count = 1;
+static struct shard *shards = NULL;
+static int listen_port = 0; //the port the first worker ended up on, which every other worker binds too
+static int server_client_count = 0; //clients across all workers, only accessed atomically
+static int server_shutting_down = 0; //0, or why the workers are stopping (SHUTDOWN_*). only accessed atomically
+static unsigned long server_start_ns = 0;
+
+//stats dumps, both handled by the first worker
+static int admin_fd = -1; //unix socket that answers every connection with a stats dump (--admin)
+static volatile sig_atomic_t stats_requested = 0; //set by SIGUSR1
+
+//hot restart. the first worker listens on the handoff socket (--handoff), and a new server that connects to it
+//(--takeover) gets every worker's listening socket, connections and matches. the workers meet at handoff_barrier
+//once none of them sends mail anymore, and main sends what they saved once they have all stopped
+static int handoff_fd = -1;
+static const char *handoff_path = NULL;
+static int takeover_conn = -1; //the new server's connection, once one has asked
+static pthread_barrier_t handoff_barrier;
+
+//what the new server received, until main has given each worker its share (see handoff_claim)
+static char *takeover_data = NULL;
+static size_t takeover_len = 0;
+static size_t takeover_off = 0; //the first record not claimed yet
+static int *takeover_fds = NULL;
+static int takeover_nfds = 0;
+static int takeover_fd_off = 0;
+
+//open-addressing (linear probing) hash set of registered names, so name checks don't depend on server size.
+//names are unique server-wide, so this is shared by all workers
+static pthread_mutex_t name_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct name_slot *name_index = NULL;
+static unsigned int name_index_slots = 0;
+static unsigned int name_index_count = 0;
+
+//cross-worker matchmaking: the worker with a lone waiting client who would take an opponent from another worker, or -1
+static pthread_mutex_t exchange_lock = PTHREAD_MUTEX_INITIALIZER;
+static int exchange_shard = -1;
+
+//connection admission (see acceptclients)
+static int listen_backlog = LISTEN_BACKLOG;
+static int max_clients = 0; //clients the server takes at most, 0 for no limit
+
+//output queue high-water marks (see OUTQ_SOFT_LIMIT and OUTQ_HARD_LIMIT)
+static size_t outq_soft_limit = OUTQ_SOFT_LIMIT;
+static size_t outq_hard_limit = OUTQ_HARD_LIMIT;
+
+//timeouts, in seconds (0 for no limit)
+static int turn_timeout = TURN_TIMEOUT;
+static int turn_forfeit = 0; //1 to forfeit the match on a turn timeout, 0 to attack automatically
+static int register_timeout = REGISTER_TIMEOUT;
+static int idle_timeout = IDLE_TIMEOUT;
+
+static uint64_t server_seed = 0; //where every worker's match seeds come from (--seed, or the clock)
+static const struct engine_rules rules = ENGINE_DEFAULT_RULES;
+
+//match journal (--journal). workers queue full buffers, and one thread writes them out
+static int journal_fd = -1;
+static pthread_t journal_thread;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static struct journal_buf *journal_head = NULL; //protected by journal_lock, as is everything below
+static struct journal_buf *journal_tail = NULL;
+static int journal_queued = 0;
+static struct journal_buf *journal_free = NULL; //written buffers, for workers to reuse
+static int journal_stopping = 0;
+
+//player profiles (--profiles): every stored profile is cached in memory, in an open-addressing index like the name
+//index. Workers only change them in memory and mark them dirty. The profile writer appends the dirty ones to the store
+//and syncs it every PROFILE_FLUSH_MS, so the disk is never on the game path and a busy profile is written once per flush
+static int profile_fd = -1;
+static pthread_t profile_thread;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t profile_cond = PTHREAD_COND_INITIALIZER;
+static struct profile_slot *profile_index = NULL; //protected by profile_lock, as is everything below
+static unsigned int profile_index_slots = 0;
+static unsigned int profile_count = 0;
+static struct profile *profile_dirty = NULL;
+static int profile_stopping = 0;
+static unsigned long profile_writes = 0; //records written. only the profile writer updates these (see STAT_ADD)
+static unsigned long profile_syncs = 0;
+static struct histogram profile_sync_time;
+
+//logging. workers put lines on their own log ring, and the log writer prints them every LOG_FLUSH_MS
+static int log_level = LOG_INFO;
+static int log_rate = LOG_RATE; //0 for no limit
+static int log_running = 0; //1 while the log writer runs (only written while no worker does)
+static int log_stopping = 0; //only accessed atomically
+static pthread_t log_thread;
+static const char *log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+//static variables private to each worker
+static __thread struct shard *shard = NULL;
+static __thread int *client_count;
+static __thread struct client *top = NULL;
+
+//matchmaking queue: registered clients waiting for an opponent, in first-come-first-served order
+static __thread struct client *wait_head = NULL;
+static __thread struct client *wait_tail = NULL;
+static __thread int wait_count = 0;
+static __thread struct client *advertised_client = NULL; //the lone waiter this worker put up for cross-worker matchmaking
+
+//the same waiting clients indexed by rating: a first-come-first-served list per bucket, and a bitmap of the buckets that
+//aren't empty, so the nearest-rated opponent is found with a few bit scans however many clients are waiting
+static __thread struct client *bucket_head[RATING_BUCKETS];
+static __thread struct client *bucket_tail[RATING_BUCKETS];
+static __thread uint64_t bucket_used[RATING_BUCKETS / 64];
+static __thread struct timer matchmaking_timer; //runs matchloneclients again while clients are left waiting
+
+//object pools
+static __thread struct pool client_pool = {"client", sizeof(struct client)};
+static __thread struct pool bufferinfo_pool = {"bufferinfo", sizeof(struct bufferinfo)};
+static __thread struct pool match_pool = {"match", sizeof(struct match)};
+static __thread struct pool player_info_pool = {"player_info", sizeof(struct player_info)};
+static __thread struct pool outchunk_pool = {"outchunk", sizeof(struct outchunk)};
+static __thread struct pool msgbuf_pool = {"msgbuf", sizeof(struct msgbuf) + MSGBUF_SMALL_LEN};
+
+//dense fd-indexed session table, so a readiness event maps straight to its client
+static __thread struct client **clients_by_fd = NULL;
+static __thread int clients_by_fd_len = 0;
+
+//clients with queued output that hasn't been written yet, and clients waiting to be removed
+static __thread struct client *flush_list = NULL;
+static __thread struct client *close_list = NULL;
+static __thread struct match *stream_list = NULL; //matches whose spectators have output coming (see flushstream)
+static __thread struct match *live_matches = NULL; //every match being played on this worker, newest first
+static __thread int live_match_count = 0;
+
+//timer wheel: level l slot i holds the timers due in the 2^(TIMER_BITS*l) ticks that map to i at that level
+static __thread struct timer timer_wheel[TIMER_LEVELS][1 << TIMER_BITS]; //list heads, circular
+static __thread unsigned long timer_now; //last tick processed
+static __thread int timer_count = 0; //armed timers
+static __thread uint64_t seed_source; //splitmix64 state that match seeds are drawn from
+static __thread struct journal_buf *journal_cur = NULL; //the buffer this worker is filling
+static __thread struct timer journal_timer; //hands a partly filled buffer over after JOURNAL_FLUSH_MS
+
+//reactor state
+static int reactor_default_backend = REACTOR_SELECT; //shared, chosen on the command line
+static __thread int reactor_backend = REACTOR_SELECT;
+#ifdef HAVE_EPOLL
+static __thread int epollfd = -1;
+#endif
+static __thread fd_set reactor_rset;
+static __thread fd_set reactor_wset;
+static __thread int reactor_maxfd = -1;
+static __thread unsigned long log_window = 0; //when the current second of the worker's log rate limit began
+static __thread int log_window_lines = 0; //lines logged in it
+static __thread int reserve_fd = -1; //kept open to be given up when the process runs out of descriptors (see acceptclients)
+
+//battlebench.c includes this file to drive the server's functions directly, with a main (and usage) of its own
+#ifndef BATTLE_NO_MAIN
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [--select] [--workers N] [--outq-soft BYTES] [--outq-hard BYTES] [--admin PATH]\n"
+                    "          [--turn-timeout SEC] [--turn-forfeit] [--register-timeout SEC] [--idle-timeout SEC] [--seed N]\n"
+                    "          [--journal PATH] [--profiles PATH] [--handoff PATH] [--takeover PATH] [--backlog N] [--max-clients N]\n"
+                    "          [--log-level LEVEL] [--log-rate N]\n", prog);
+    fprintf(stderr, "  --select            use the select() backend instead of epoll\n");
+    fprintf(stderr, "  --workers N         run N worker threads, each with its own SO_REUSEPORT listening socket (default 1)\n");
+    fprintf(stderr, "  --outq-soft BYTES   stop reading from clients with more than BYTES of unsent output (default %d)\n", OUTQ_SOFT_LIMIT);
+    fprintf(stderr, "  --outq-hard BYTES   disconnect clients with more than BYTES of unsent output (default %d)\n", OUTQ_HARD_LIMIT);
+    fprintf(stderr, "  --admin PATH        answer connections to unix socket PATH with a stats dump (SIGUSR1 prints one too)\n");
+    fprintf(stderr, "  --turn-timeout SEC  seconds a player has for a move, 0 for no limit (default %d)\n", TURN_TIMEOUT);
+    fprintf(stderr, "  --turn-forfeit      a player who runs out of time loses the match, instead of attacking automatically\n");
+    fprintf(stderr, "  --register-timeout SEC  seconds a new connection has to send its name, 0 for no limit (default %d)\n", REGISTER_TIMEOUT);
+    fprintf(stderr, "  --idle-timeout SEC  seconds a player outside a match may send nothing before being dropped, 0 for no limit (default %d)\n", IDLE_TIMEOUT);
+    fprintf(stderr, "  --seed N            derive every match seed from N, so a whole run can be reproduced (default: the clock)\n");
+    fprintf(stderr, "  --journal PATH      append a record of every match to PATH (read it with journalscan)\n");
+    fprintf(stderr, "  --profiles PATH     keep every player's wins, losses and rating in PATH, from one run to the next\n");
+    fprintf(stderr, "  --handoff PATH      hand every connection and match over to a new server that connects to unix socket PATH, then exit\n");
+    fprintf(stderr, "  --takeover PATH     start by taking over from the server with --handoff PATH (and its number of workers)\n");
+    fprintf(stderr, "  --backlog N         connections the kernel queues for each listening socket (default %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  --max-clients N     turn new connections away while N clients are connected, 0 for no limit (default 0)\n");
+    fprintf(stderr, "  --log-level LEVEL   error, warn, info, debug or trace (every read) (default info)\n");
+    fprintf(stderr, "  --log-rate N        lines per second each worker may log, the rest are dropped, 0 for no limit (default %d)\n", LOG_RATE);
+    exit(1);
+}
 
-int main() 
+int main(int argc, char **argv) 
 {
-    int clientfd, maxfd, nready;
-    socklen_t len;
-    struct sockaddr_in q;
-    struct timeval tv;
-    fd_set allset;
-    fd_set rset;
+    int i, opt;
+    char *admin_path = NULL;
+    int seeded = 0;
+    char *journal_path = NULL;
+    char *profile_path = NULL;
+    char *takeover_path = NULL;
+
+#ifdef HAVE_EPOLL
+    reactor_default_backend = REACTOR_EPOLL;
+#else
+    reactor_default_backend = REACTOR_SELECT;
+#endif
 
-    int i;
+    static struct option long_options[] = {
+        {"select", no_argument, NULL, 's'},
+        {"workers", required_argument, NULL, 'w'},
+        {"outq-soft", required_argument, NULL, 'o'},
+        {"outq-hard", required_argument, NULL, 'O'},
+        {"admin", required_argument, NULL, 'a'},
+        {"turn-timeout", required_argument, NULL, 't'},
+        {"turn-forfeit", no_argument, NULL, 'f'},
+        {"register-timeout", required_argument, NULL, 'r'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"seed", required_argument, NULL, 'S'},
+        {"journal", required_argument, NULL, 'j'},
+        {"profiles", required_argument, NULL, 'P'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"takeover", required_argument, NULL, 'T'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"max-clients", required_argument, NULL, 'm'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"log-rate", required_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "sw:o:O:a:t:fr:i:S:j:P:H:T:b:m:l:L:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            reactor_default_backend = REACTOR_SELECT;
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        case 'o':
+            outq_soft_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'O':
+            outq_hard_limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            admin_path = optarg;
+            break;
+        case 't':
+            turn_timeout = atoi(optarg);
+            break;
+        case 'f':
+            turn_forfeit = 1;
+            break;
+        case 'r':
+            register_timeout = atoi(optarg);
+            break;
+        case 'i':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'S':
+            server_seed = strtoull(optarg, NULL, 0);
+            seeded = 1;
+            break;
+        case 'j':
+            journal_path = optarg;
+            break;
+        case 'P':
+            profile_path = optarg;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'T':
+            takeover_path = optarg;
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            break;
+        case 'm':
+            max_clients = atoi(optarg);
+            break;
+        case 'l':
+            for (log_level = LOG_TRACE; log_level >= 0 && strcasecmp(optarg, log_level_names[log_level]) != 0; log_level--);
+            if (log_level < 0) {
+                fprintf(stderr, "unknown log level %s\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'L':
+            log_rate = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    client_count = malloc(sizeof(int));
-    *client_count = 0;
+    if (outq_soft_limit == 0 || outq_hard_limit < outq_soft_limit) {
+        fprintf(stderr, "--outq-hard must be at least --outq-soft, and both must be positive\n");
+        usage(argv[0]);
+    }
 
-    srand(time(0)); //seed RNG
+    if (turn_timeout < 0 || register_timeout < 0 || idle_timeout < 0) {
+        fprintf(stderr, "timeouts must not be negative\n");
+        usage(argv[0]);
+    }
 
-    int listenfd = bindandlisten();
-    printf("Port number: %d\n", PORT);
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
+    if (log_rate < 0) {
+        fprintf(stderr, "--log-rate must not be negative\n");
+        usage(argv[0]);
+    }
 
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-        
-        //jamie
-        if (*client_count == 0)
-        {
-            //if server is empty, wait a couple seconds before shutting down (unless a client joins)
-            
-            //timeout variable
-            tv.tv_sec = TIMEOUT_SECONDS; //seconds
-            tv.tv_usec = 0; //microseconds
+    if (listen_backlog < 1 || max_clients < 0) {
+        fprintf(stderr, "--backlog must be positive, and --max-clients must not be negative\n");
+        usage(argv[0]);
+    }
 
-            nready = select(maxfd + 1, &rset, NULL, NULL, &tv);
-            
-            if (nready == 0)
-            {
-                //timeout
-                printf("Server has been empty for %d seconds. Shutting down...\n", TIMEOUT_SECONDS);
-                break;
-            }
-        }
-        else {
-            nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        }
-        
-        if (nready == -1) {
-            perror("select");
-            continue;
-        }
-        
-        //shahar
-        if (FD_ISSET(listenfd, &rset)){
-            len = sizeof(q);
-            
-            if ((clientfd = accept(listenfd, (struct sockaddr *)&q, &len)) < 0) {
-                perror("accept");
-                exit(1);
-            }
-            
-            FD_SET(clientfd, &allset);
-            
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-            
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
+    if (worker_count < 1 || worker_count > MAX_WORKERS) {
+        fprintf(stderr, "--workers must be between 1 and %d\n", MAX_WORKERS);
+        usage(argv[0]);
+    }
 
-            struct client *new_client = addclient(clientfd, q.sin_addr);
-            welcomeclient(new_client);
-        }
-        //shahr end
+    //a client hanging up mid-write shows up as EPIPE from writev, not as a signal
+    signal(SIGPIPE, SIG_IGN);
 
-        for(i = 0; i <= maxfd; i++) {
-            if (FD_ISSET(i, &rset)) {
-                struct client *p;
-                for (p = top; p; p = p->next) {
-                    if (p->fd == i) {
-                        if (handleclient(p) == -1) {
-                            int tmp_fd = p->fd;
+    server_start_ns = nowns();
+    if (!seeded) {
+        server_seed = (uint64_t) time(0) ^ server_start_ns;
+    }
+    printf("Seed: %llu\n", (unsigned long long) server_seed);
 
-                            removeclient(p);
+    //SIGUSR1 asks the first worker for a stats dump. it must not restart reactor_wait, so the worker notices right away
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requeststats;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
 
-                            FD_CLR(tmp_fd, &allset);
-                            close(tmp_fd);
-                        }
-                        break;
-                    }
-                }
-            }
-        }
+    //the old server finishes with its sockets, journal and profiles before it hands over, so take over before using any of them
+    if (takeover_path && takeover(takeover_path) == -1) {
+        exit(1);
     }
 
-    free(client_count);
-    return 0;
-}
-
-int handleclient(struct client *p) {
-    char buf[1];
-    int len = read(p->fd, buf, sizeof(char));
+    if (admin_path && (admin_fd = bindunix(admin_path, "Admin")) == -1) {
+        exit(1);
+    }
 
-    if (!p->name_registered)
-    {
-        //read the client's name's characters, one by one
+    if (handoff_path && (handoff_fd = bindunix(handoff_path, "Handoff")) == -1) {
+        exit(1);
+    }
 
-        if (buf[0] == '\n')
-        {
-            p->bufferinfo->buffer[p->bufferinfo->buffer_index] = '\0';
-            registername(p, p->bufferinfo->buffer);
-            resetbuffer(p);
-            matchloneclients();
-        }
-        else {
-            p->bufferinfo->buffer[p->bufferinfo->buffer_index] = buf[0];
-            p->bufferinfo->buffer_index++;
-        }
-        
-        return 0;
+    if (journal_path && (journal_fd = journal_open(journal_path)) == -1) {
+        exit(1);
     }
-    
-    if (len > 0)
-    {
-        printf("Received %d bytes from %s: %s\n", len, p->name, buf);
 
-        //game logic
+    if (profile_path && (profile_fd = profile_open(profile_path)) == -1) {
+        exit(1);
+    }
 
-        //shahr start
-        if (p->in_match && p->current_match->active_player == p)
-        {
-            if (p->current_match->speech_state)
-            {
-                //BUFFER BYTES HERE
-                if (buf[0] == '\n')
-                {
-                    p->bufferinfo->buffer[p->bufferinfo->buffer_index] = '\0';
+    shards = calloc(worker_count, sizeof(struct shard));
+    if (!shards) {
+        perror("calloc");
+        exit(1);
+    }
 
-                    //speak
-                    speak(p, p->bufferinfo->buffer);
-                    
-                    //untoggle speech state
-                    p->current_match->speech_state = 0;
-                    //untoggle buffering state
-                    p->bufferinfo->buffering_input = 0;
+    //bind every listening socket up front, so a failure aborts before any worker starts (or take the old server's)
+    for (i = 0; i < worker_count; i++) {
+        shards[i].id = i;
+        shards[i].listenfd = takeover_path ? handoff_claim(&shards[i]) : bindandlisten();
+        shards[i].wakefd[0] = shards[i].wakefd[1] = -1;
+        pthread_mutex_init(&shards[i].lock, NULL);
 
-                    resetbuffer(p);
-                }
-                else {
-                    p->bufferinfo->buffer[p->bufferinfo->buffer_index] = buf[0];
-                    p->bufferinfo->buffer_index++;
-                }
-            } 
-            else if (strcmp(buf, "a") == 0 || strcmp(buf, "p") == 0 || strcmp(buf, "r") == 0)
-            {
-                if (strcmp(buf, "a") == 0) {
-                    //regular attack
-                    attack(p);
-                }
-                else if (strcmp(buf, "p") == 0) {
-                    if (p->player_info->powermoves_remaining > 0)
-                    {
-                        //powermove
-                        usepowermove(p);
-                    }
-                    else {
-                        return 0;
-                    }
-                }
-                else if (strcmp(buf, "r") == 0) {
-                    if (p->player_info->hp_regens_remaining > 0)
-                    {
-                        //regenerate hp
-                        usehealthregen(p);
-                        updatedisplay(p->current_match, 1);
-                    }
+        if (!(shards[i].log = calloc(1, sizeof(struct log_ring)))) {
+            perror("calloc");
+            exit(1);
+        }
 
-                    return 0;
-                }
-                
-                if (checkifmatchended(p->current_match) == 1)
-                {
-                    //sending winner and loser messages
-                    broadcast_to_client(p->current_match->winner, "You killed your opponent. You win!\n");
-                    broadcast_to_client(p->current_match->loser, "You have died. You lose!\n");
-                    
-                    broadcast_to_client(p->current_match->winner, "\nAwaiting next opponent...\n");
-                    broadcast_to_client(p->current_match->loser, "\nAwaiting next opponent...\n");
-
-                    //IMPORTANT: endmatch call must come AFTER broadcast messages to avoid a seg fault
-                    endmatch(p->current_match);
-                    return 0;
-                }
-                
-                switchturn(p->current_match);
-            
-            }
-            else if (strcmp(buf, "s") == 0 && p->current_match->speech_state == 0)
-            {
-                p->current_match->speech_state = 1;
-                p->bufferinfo->buffering_input = 1;
-                broadcast_to_client(p, "\nSpeak: ");
+        if (worker_count > 1) {
+            if (pipe(shards[i].wakefd) == -1) {
+                perror("pipe");
+                exit(1);
             }
-   
-        //shahr end
+            setnonblocking(shards[i].wakefd[0]);
+            setnonblocking(shards[i].wakefd[1]);
         }
-        else {
-            broadcast_to_client(p, "\nWait your turn...\n");
-        }
-        
-        return 0;
-    }
-    else {
-        // socket is closed, disconnect client
-        return -1;
     }
-}
 
-void resetbuffer(struct client *c) {
-    c->bufferinfo->buffer_index = 0;
-    memset(c->bufferinfo->buffer, 0, MAX_BUFFER_LEN);
-}
+    free(takeover_data);
+    free(takeover_fds);
+    pthread_barrier_init(&handoff_barrier, NULL, worker_count);
 
- /* bind and listen, abort on error
-  * returns FD of listening socket
-  */
-int bindandlisten() {
-    struct sockaddr_in r;
-    int listenfd;
+    printf("Port number: %d\n", listen_port);
+    if (worker_count > 1) {
+        printf("Workers: %d\n", worker_count);
+    }
 
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket");
+    //the first worker runs on the main thread, and only it takes SIGUSR1 (the other workers inherit it blocked)
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+    if (pthread_create(&log_thread, NULL, logwriter, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
         exit(1);
     }
-    int yes = 1;
-    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
-        perror("setsockopt");
-    }
-    memset(&r, '\0', sizeof(r));
-    r.sin_family = AF_INET;
-    r.sin_addr.s_addr = INADDR_ANY;
-    r.sin_port = htons(PORT);
+    log_running = 1;
 
-    int i = 0;
-    while (bind(listenfd, (struct sockaddr *)&r, sizeof r) == -1)
-    {
-        printf("Port %d is already in use...trying port %d\n", PORT + i, PORT + i + 1);
-        i++;
-        r.sin_port = htons(PORT + i);
+    if (journal_fd != -1 && pthread_create(&journal_thread, NULL, journalwriter, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        exit(1);
     }
 
-    if (listen(listenfd, 5)) {
-        perror("listen");
+    if (profile_fd != -1 && pthread_create(&profile_thread, NULL, profilewriter, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
         exit(1);
     }
-    return listenfd;
-}
 
-struct client *addclient(int fd, struct in_addr addr) {
-    struct client *p = malloc(sizeof(struct client));
-    if (!p) {
-        perror("malloc");
-        exit(1);
+    for (i = 1; i < worker_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, runworker, &shards[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
     }
 
-    p->fd = fd;
-    p->ipaddr = addr;
-    p->next = top;
-    p->name_registered = 0;
-    p->in_match = 0;
-    p->client_just_played = NULL;
+    pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
 
-    p->bufferinfo = malloc(sizeof(struct bufferinfo));
+    runworker(&shards[0]);
 
-    top = p;
+    for (i = 1; i < worker_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
 
-    (*client_count)++;
-    return p;
-}
+    //every worker has logged its last line
+    log_stop();
+    for (i = 0; i < worker_count; i++) {
+        free(shards[i].log);
+        shards[i].log = NULL;
+    }
 
-void removeclient(struct client *c) {
-    if (c == top)
-    {
-        top = c->next;
+    //every worker has handed over its last journal buffer, and made its last profile change, by now
+    if (journal_fd != -1) {
+        journal_stop();
     }
-    else {
-        struct client *p;
 
-        for (p = top; p && p->next != c; p = p->next);
-        // Now, p points to the client just before c
+    if (profile_fd != -1) {
+        profile_stop();
+    }
 
-        //removing c from the linked list of clients, but not yet deleting it
-        p->next = c->next;
+    if (admin_fd != -1) {
+        close(admin_fd);
+        unlink(admin_path);
     }
 
-    if (c) {
-        printf("Disconnect from %s (%s)\n", inet_ntoa(c->ipaddr), c->name);
+    if (handoff_fd != -1) {
+        close(handoff_fd);
+    }
 
-        if (c->client_just_played)
-        {
-            c->client_just_played->client_just_played = NULL;
-        }
+    //the new server binds the admin and handoff sockets once it has everything, so they must be gone by then
+    if (server_shutting_down == SHUTDOWN_HANDOFF) {
+        handoff_send();
+    }
+    else if (handoff_fd != -1) {
+        unlink(handoff_path);
+    }
 
-        char outbuf[MAX_MSG_LEN];
-        sprintf(outbuf, "**%s leaves**\r\n", c->name);
-        broadcast_all(c, outbuf, strlen(outbuf));
+    pthread_barrier_destroy(&handoff_barrier);
+    return 0;
+}
+#endif
 
-        if (c->in_match)
-        {
-            c->current_match->winner = (c->current_match->active_player == c) ? c->current_match->non_active_player : c->current_match->active_player;
-            c->current_match->loser = c;
+/*
+Event loop of a single worker. Returns once the whole server has been empty for TIMEOUT_SECONDS
+*/
+void *runworker(void *arg) {
+    int nready;
+    struct reactor_event events[MAX_EVENTS];
+    unsigned long empty_since = 0; //when this worker was last seen empty with nothing happening, 0 if it wasn't
+    int i;
 
-            //sending winner and loser messages
-            broadcast_to_client(c->current_match->winner, "--Opponent dropped. You win!\n");
-            broadcast_to_client(c->current_match->winner, "\nAwaiting next opponent...\n");
-            
-            endmatch(c->current_match);
-        }
+    shard = arg;
+    int listenfd = shard->listenfd;
 
-        free(c);
-    } else {
-        printf("ERROR\n");
+    client_count = malloc(sizeof(int));
+    *client_count = 0;
+
+    if (reactor_init(reactor_default_backend) == -1) {
         exit(1);
     }
 
-    (*client_count)--;
+    //the listening socket is non-blocking (accepting drains it until EAGAIN) and level-triggered, so whatever
+    //acceptclients leaves for later is reported again on the next wakeup. the old server's may be blocking still
+    if (setnonblocking(listenfd) == -1 || reactor_add(listenfd, REACTOR_READ) == -1) {
+        exit(1);
+    }
 
-    matchloneclients();
-}
+    //when the process runs out of descriptors, giving this one up lets the worker turn a connection away properly
+    if ((reserve_fd = open("/dev/null", O_RDONLY)) == -1) {
+        perror("/dev/null");
+    }
 
-void broadcast_all(struct client *sender, char *s, int size) {
-    struct client *p;
+    if (shard->wakefd[0] != -1 && reactor_add(shard->wakefd[0], REACTOR_READ) == -1) {
+        exit(1);
+    }
 
-    //note: do not broadcast to the sender, and only broadcast to clients who have entered their name
-    for (p = top; p; p = p->next) {
-        if (p != sender && strlen(p->name) > 0)
-        {
-            broadcast_to_client(p, s);
-        }
+    if (shard->id == 0 && admin_fd != -1 && reactor_add(admin_fd, REACTOR_READ) == -1) {
+        exit(1);
     }
-}
 
-void broadcast_to_client(struct client *c, char *s) {
-    if (write(c->fd, s, strlen(s)) == -1) {
-        perror("write");
+    if (shard->id == 0 && handoff_fd != -1 && reactor_add(handoff_fd, REACTOR_READ) == -1) {
         exit(1);
     }
-}
 
+    timer_start();
+    timer_init(&journal_timer, journal_flushtimer, NULL);
+    timer_init(&matchmaking_timer, matchmakingretry, NULL);
 
-/*
-Register name of client c
-returns -1 if there was an error reading, 0 if username is already taken, and 1 if successful
-*/
-int registername(struct client *c, char *s) {
-    strcpy(c->name, s);
+    //each worker draws match seeds from its own stream. consecutive splitmix64 states only differ by a constant,
+    //so start each worker at a scrambled point rather than one step apart, or the workers would share seeds
+    uint64_t worker_seed = server_seed + shard->id;
+    seed_source = splitmix64(&worker_seed);
 
-    if (strlen(s) == 0)
-    {
-        char *s = "Sorry, you cannot type an empty name. Please try again:\n";
-        broadcast_to_client(c, s); //alert the client
+    //let stats dumps from other workers see this worker's pools
+    struct pool *pools[POOL_COUNT] = {&client_pool, &bufferinfo_pool, &match_pool, &player_info_pool, &outchunk_pool, &msgbuf_pool};
+    pthread_mutex_lock(&shard->lock);
+    shard->pools = pools;
+    pthread_mutex_unlock(&shard->lock);
+
+    //pick up the connections and matches the old server's worker had
+    if (shard->handoff_data) {
+        handoff_restore();
+    }
+
+    while (!__atomic_load_n(&server_shutting_down, __ATOMIC_ACQUIRE)) {
+        //jamie
+        if (*client_count == 0)
+        {
+            //if server is empty, wait a couple seconds before shutting down (unless a client joins). timers that are
+            //still armed (e.g. the journal flush) keep their ticks meanwhile
+            unsigned long now = nowns();
+            if (!empty_since) {
+                empty_since = now;
+            }
+            unsigned long waited_ms = (now - empty_since) / 1000000UL;
+            int wait_ms = waited_ms < TIMEOUT_SECONDS * 1000UL ? (int) (TIMEOUT_SECONDS * 1000UL - waited_ms) : 0;
+            int timer_ms = timer_wait_ms();
+            if (timer_ms != -1 && timer_ms < wait_ms) {
+                wait_ms = timer_ms;
+            }
+
+            nready = reactor_wait(events, MAX_EVENTS, wait_ms);
+            if (nready != 0) {
+                empty_since = 0; //something happened, so the wait starts over
+            }
+            
+            if (nready == 0 && nowns() - empty_since >= TIMEOUT_SECONDS * 1000000000UL)
+            {
+                //timeout. other workers may still have clients
+                if (__atomic_load_n(&server_client_count, __ATOMIC_ACQUIRE) > 0) {
+                    empty_since = 0;
+                    timer_run();
+                    continue;
+                }
+
+                //unless a new server is taking over already
+                int expected = 0;
+                if (!__atomic_compare_exchange_n(&server_shutting_down, &expected, SHUTDOWN_EMPTY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    break;
+                }
+                LOG(LOG_INFO, "Server has been empty for %d seconds. Shutting down...", TIMEOUT_SECONDS);
+
+                //take every other worker down with us
+                for (i = 0; i < worker_count; i++) {
+                    if (i != shard->id) {
+                        sendmail(&shards[i], NULL);
+                    }
+                }
+                break;
+            }
+        }
+        else {
+            //wake up for the next tick while any timer is armed
+            empty_since = 0;
+            nready = reactor_wait(events, MAX_EVENTS, timer_wait_ms());
+        }
+
+        if (shard->id == 0 && stats_requested) {
+            stats_requested = 0;
+            printstats(stdout);
+            fflush(stdout);
+        }
+        
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("reactor_wait");
+            }
+            continue;
+        }
+
+        for (i = 0; i < nready; i++) {
+            int fd = events[i].fd;
+
+            //shahar
+            if (fd == listenfd) {
+                acceptclients(listenfd);
+                continue;
+            }
+            //shahr end
+
+            if (fd == shard->wakefd[0]) {
+                handlemail();
+                continue;
+            }
+
+            if (fd == admin_fd) {
+                handleadmin();
+                continue;
+            }
+
+            if (fd == handoff_fd) {
+                handlehandoff();
+                continue;
+            }
+
+            struct client *p = clientbyfd(fd);
+            if (!p || p->closing) {
+                continue;
+            }
+
+            if (events[i].events & REACTOR_WRITE) {
+                flushclient(p);
+            }
+
+            if ((events[i].events & REACTOR_READ) && !p->throttled && !p->closing) {
+                int result;
+
+                //drain the socket (unless the client gets throttled or dropped along the way)
+                do {
+                    unsigned long start = nowns();
+                    result = handleclient(p);
+                    recordtime(&shard->metrics.handleclient_time, nowns() - start);
+                } while (result == 0 && !p->throttled && !p->closing);
+
+                if (result == -1) {
+                    markclosing(p);
+                }
+            }
+        }
+
+        //deadlines that came due while handling (or waiting for) events
+        timer_run();
+
+        //hand every match's stream to its spectators, then write out everything this round produced, then drop the clients
+        //that went away (removing a client produces more output, so keep going until both lists are empty)
+        flushstreams();
+        flushpending();
+        while (close_list) {
+            reapclients();
+            flushpending();
+        }
+
+        //nothing refers to any client at this point, so this is where a lone waiter can move to another worker
+        if (worker_count > 1) {
+            exchangelonewaiter();
+        }
+    }
+
+    //save everything for the new server (which may still start matches, so before the last journal buffer goes out)
+    if (__atomic_load_n(&server_shutting_down, __ATOMIC_ACQUIRE) == SHUTDOWN_HANDOFF) {
+        handoff_save();
+    }
+
+    if (journal_cur) {
+        journal_submit();
+    }
+
+    printpoolstats(stdout, shard);
+
+    pthread_mutex_lock(&shard->lock);
+    shard->pools = NULL;
+    pthread_mutex_unlock(&shard->lock);
+
+    pool_destroy(&client_pool);
+    pool_destroy(&bufferinfo_pool);
+    pool_destroy(&match_pool);
+    pool_destroy(&player_info_pool);
+    pool_destroy(&outchunk_pool);
+    pool_destroy(&msgbuf_pool);
+
+    //a listening socket that is being handed over stays open until it has been sent
+    reactor_del(listenfd);
+    if (__atomic_load_n(&server_shutting_down, __ATOMIC_ACQUIRE) != SHUTDOWN_HANDOFF) {
+        close(listenfd);
+    }
+    if (reserve_fd != -1) {
+        close(reserve_fd);
+    }
+    free(clients_by_fd);
+    free(client_count);
+    return NULL;
+}
+
+/*
+Returns an uninitialised object from pool, carving a new slab when the free list is empty
+*/
+void *pool_alloc(struct pool *pool) {
+    if (!pool->free_list) {
+        //round objects up so every one of them stays suitably aligned, and leave room for the slab link
+        size_t objsize = (pool->objsize + 15) & ~(size_t) 15;
+        char *slab = malloc(16 + objsize * POOL_SLAB_OBJECTS);
+        if (!slab) {
+            perror("malloc");
+            exit(1);
+        }
+
+        *(void **) slab = pool->slabs;
+        pool->slabs = slab;
+        STAT_ADD(pool->slab_count, 1);
+
+        int i;
+        for (i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+            void *obj = slab + 16 + i * objsize;
+            *(void **) obj = pool->free_list;
+            pool->free_list = obj;
+        }
+    }
+
+    void *obj = pool->free_list;
+    pool->free_list = *(void **) obj;
+
+    STAT_ADD(pool->allocs, 1);
+    STAT_ADD(pool->in_use, 1);
+    if (pool->in_use > pool->peak) {
+        STAT_SET(pool->peak, pool->in_use);
+    }
+    return obj;
+}
+
+/*
+Returns obj to pool for reuse. obj must have come from the same pool (and so from the same worker). NULL is ignored
+*/
+void pool_free(struct pool *pool, void *obj) {
+    if (!obj) {
+        return;
+    }
+
+    *(void **) obj = pool->free_list;
+    pool->free_list = obj;
+
+    STAT_ADD(pool->frees, 1);
+    STAT_ADD(pool->in_use, -1);
+}
+
+/*
+Releases every slab of pool. Only used once nothing from it is in use anymore
+*/
+void pool_destroy(struct pool *pool) {
+    while (pool->slabs) {
+        void *next = *(void **) pool->slabs;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+
+    pool->free_list = NULL;
+    STAT_SET(pool->slab_count, 0);
+}
+
+/*
+Prints the pool counters of worker s (which may be another thread), if it is still running
+*/
+void printpoolstats(FILE *out, struct shard *s) {
+    int i;
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; s->pools && i < POOL_COUNT; i++) {
+        struct pool *p = s->pools[i];
+        unsigned long slabs = STAT_GET(p->slab_count);
+
+        fprintf(out, "worker %d pool %-12s in use %lu, peak %lu, slabs %lu (%lu bytes), allocs %lu, frees %lu\n",
+                s->id, p->name, STAT_GET(p->in_use), STAT_GET(p->peak), slabs,
+                slabs * (16 + ((p->objsize + 15) & ~(size_t) 15) * POOL_SLAB_OBJECTS), STAT_GET(p->allocs), STAT_GET(p->frees));
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+Returns a monotonic timestamp in nanoseconds
+*/
+unsigned long nowns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+Adds a sample of ns nanoseconds to this worker's histogram h
+*/
+void recordtime(struct histogram *h, unsigned long ns) {
+    int bucket = ns ? 63 - __builtin_clzl(ns) : 0;
+    if (bucket >= HIST_BUCKETS) {
+        bucket = HIST_BUCKETS - 1;
+    }
+
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->total_ns, ns);
+    STAT_ADD(h->buckets[bucket], 1);
+    if (ns > h->max_ns) {
+        STAT_SET(h->max_ns, ns);
+    }
+}
+
+/*
+Formats a duration in nanoseconds with a readable unit
+*/
+static char *formatns(char *buf, size_t size, double ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%.0fns", ns);
+    }
+    else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", ns / 1000);
+    }
+    else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", ns / 1000000);
+    }
+    else {
+        snprintf(buf, size, "%.1fs", ns / 1000000000);
+    }
+    return buf;
+}
+
+/*
+Prints histogram h (summed over every worker by the caller). Percentiles are the upper bound of the bucket they fall in
+*/
+static void printhistogram(FILE *out, const char *label, struct histogram *h) {
+    char mean[16], p50[16], p99[16], max[16];
+    unsigned long seen = 0;
+    int i, b50 = -1, b99 = -1;
+
+    if (h->count == 0) {
+        fprintf(out, "%-18s n=0\n", label);
+        return;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (b50 == -1 && seen * 100 >= h->count * 50) {
+            b50 = i;
+        }
+        if (b99 == -1 && seen * 100 >= h->count * 99) {
+            b99 = i;
+        }
+    }
+
+    fprintf(out, "%-18s n=%lu mean %s p50 <%s p99 <%s max %s\n", label, h->count,
+            formatns(mean, sizeof(mean), (double) h->total_ns / h->count),
+            formatns(p50, sizeof(p50), (double) (1UL << (b50 + 1))),
+            formatns(p99, sizeof(p99), (double) (1UL << (b99 + 1))),
+            formatns(max, sizeof(max), (double) h->max_ns));
+}
+
+/*
+Adds worker counters from into total
+*/
+static void addhistogram(struct histogram *total, struct histogram *from) {
+    int i;
+
+    total->count += STAT_GET(from->count);
+    total->total_ns += STAT_GET(from->total_ns);
+    if (STAT_GET(from->max_ns) > total->max_ns) {
+        total->max_ns = STAT_GET(from->max_ns);
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total->buckets[i] += STAT_GET(from->buckets[i]);
+    }
+}
+
+/*
+Prints a stats dump: server-wide totals, then each worker's gauges and pools
+*/
+void printstats(FILE *out) {
+    struct metrics t;
+    int i;
+
+    memset(&t, 0, sizeof(t));
+    for (i = 0; i < worker_count; i++) {
+        struct metrics *m = &shards[i].metrics;
+
+        t.accepts += STAT_GET(m->accepts);
+        t.rejected += STAT_GET(m->rejected);
+        t.disconnects += STAT_GET(m->disconnects);
+        t.bytes_in += STAT_GET(m->bytes_in);
+        t.bytes_out += STAT_GET(m->bytes_out);
+        t.syscalls += STAT_GET(m->syscalls);
+        t.commands += STAT_GET(m->commands);
+        t.matches_started += STAT_GET(m->matches_started);
+        t.matches_ended += STAT_GET(m->matches_ended);
+        t.turn_timeouts += STAT_GET(m->turn_timeouts);
+        t.evictions += STAT_GET(m->evictions);
+        t.journal_records += STAT_GET(m->journal_records);
+        t.journal_dropped += STAT_GET(m->journal_dropped);
+        t.log_dropped += STAT_GET(m->log_dropped);
+        t.clients += STAT_GET(m->clients);
+        t.lobby += STAT_GET(m->lobby);
+        addhistogram(&t.matchmaking, &m->matchmaking);
+        addhistogram(&t.handleclient_time, &m->handleclient_time);
+        addhistogram(&t.matchloneclients_time, &m->matchloneclients_time);
+        addhistogram(&t.broadcast_all_time, &m->broadcast_all_time);
+    }
+
+    double uptime = (nowns() - server_start_ns) / 1e9;
+
+    fprintf(out, "--- stats: uptime %.1fs, %d worker(s)\n", uptime, worker_count);
+    fprintf(out, "clients %lu, lobby %lu, active matches %lu\n", t.clients, t.lobby, t.matches_started - t.matches_ended);
+    fprintf(out, "accepts %lu (%.1f/s), rejected %lu, disconnects %lu\n", t.accepts, t.accepts / uptime, t.rejected, t.disconnects);
+    fprintf(out, "bytes in %lu, bytes out %lu\n", t.bytes_in, t.bytes_out);
+    fprintf(out, "commands %lu, syscalls %lu (%.2f per command)\n", t.commands, t.syscalls,
+            t.commands ? (double) t.syscalls / t.commands : 0.0);
+    fprintf(out, "matches started %lu, ended %lu\n", t.matches_started, t.matches_ended);
+    fprintf(out, "turn timeouts %lu, evictions %lu\n", t.turn_timeouts, t.evictions);
+    fprintf(out, "log lines dropped %lu\n", t.log_dropped);
+    if (journal_fd != -1) {
+        fprintf(out, "journal records %lu, dropped %lu\n", t.journal_records, t.journal_dropped);
+    }
+    if (profile_fd != -1) {
+        fprintf(out, "profiles %u, records written %lu, syncs %lu\n", STAT_GET(profile_count), STAT_GET(profile_writes), STAT_GET(profile_syncs));
+    }
+    printhistogram(out, "matchmaking", &t.matchmaking);
+    printhistogram(out, "handleclient", &t.handleclient_time);
+    printhistogram(out, "matchloneclients", &t.matchloneclients_time);
+    printhistogram(out, "broadcast_all", &t.broadcast_all_time);
+    if (profile_fd != -1) {
+        struct histogram h;
+        memset(&h, 0, sizeof(h));
+        addhistogram(&h, &profile_sync_time);
+        printhistogram(out, "profile write+sync", &h);
+    }
+
+    for (i = 0; i < worker_count; i++) {
+        struct metrics *m = &shards[i].metrics;
+
+        fprintf(out, "worker %d clients %lu, lobby %lu, active matches %lu, accepts %lu, commands %lu\n", i,
+                STAT_GET(m->clients), STAT_GET(m->lobby), STAT_GET(m->matches_started) - STAT_GET(m->matches_ended),
+                STAT_GET(m->accepts), STAT_GET(m->commands));
+        printpoolstats(out, &shards[i]);
+    }
+}
+
+/*
+Answers a connection to the admin socket with a stats dump, then hangs up
+*/
+void handleadmin() {
+    int fd = accept(admin_fd, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    //the dump is a few KB and the peer is local, so a blocking write is fine here
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        return;
+    }
+
+    printstats(out);
+    fclose(out);
+}
+
+/*
+SIGUSR1 handler: the first worker prints a stats dump once reactor_wait returns
+*/
+void requeststats(int sig) {
+    stats_requested = 1;
+}
+
+/*
+Creates a unix socket at path (the what socket, e.g. "Admin"), replacing a stale one
+returns the listening socket, or -1 on error
+*/
+int bindunix(const char *path, const char *what) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s socket path is too long: %s\n", what, path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 5) == -1 || setnonblocking(fd) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    printf("%s socket: %s\n", what, path);
+    return fd;
+}
+
+/*
+A new server connected to the handoff socket: stop every worker, so that they save their state for it (see handoff_save)
+*/
+void handlehandoff() {
+    int fd = accept(handoff_fd, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    //a server that is shutting down anyway has nothing to hand over, the new one just sees the connection close
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&server_shutting_down, &expected, SHUTDOWN_HANDOFF, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        return;
+    }
+
+    LOG(LOG_INFO, "A new server is taking over...");
+    takeover_conn = fd;
+
+    //nobody else gets in, and the new server binds its own handoff socket here once it has everything.
+    //the socket itself stays open until the workers have stopped, since they all compare descriptors with handoff_fd
+    reactor_del(handoff_fd);
+    unlink(handoff_path);
+
+    int i;
+    for (i = 0; i < worker_count; i++) {
+        if (i != shard->id) {
+            sendmail(&shards[i], NULL);
+        }
+    }
+}
+
+/*
+Appends len bytes from data to this worker's handoff records
+*/
+void handoff_append(const void *data, size_t len) {
+    if (shard->handoff_len + len > shard->handoff_cap) {
+        size_t cap = shard->handoff_cap ? shard->handoff_cap : HANDOFF_CHUNK_LEN;
+        while (cap < shard->handoff_len + len) {
+            cap *= 2;
+        }
+
+        if (!(shard->handoff_data = realloc(shard->handoff_data, cap))) {
+            perror("realloc");
+            exit(1);
+        }
+        shard->handoff_cap = cap;
+    }
+
+    memcpy(shard->handoff_data + shard->handoff_len, data, len);
+    shard->handoff_len += len;
+}
+
+/*
+Adds fd to the descriptors that go with this worker's handoff records
+*/
+void handoff_addfd(int fd) {
+    if (shard->handoff_nfds == shard->handoff_fds_cap) {
+        shard->handoff_fds_cap = shard->handoff_fds_cap ? shard->handoff_fds_cap * 2 : HANDOFF_MAX_FDS;
+        if (!(shard->handoff_fds = realloc(shard->handoff_fds, shard->handoff_fds_cap * sizeof(int)))) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    shard->handoff_fds[shard->handoff_nfds++] = fd;
+}
+
+/*
+Saves client c for the new server: everything about it, the half line it has sent and the output it hasn't been sent yet
+*/
+void handoff_saveclient(struct client *c) {
+    struct handoff_client hc;
+    struct handoff_record r;
+    struct outchunk *chunk;
+
+    memset(&hc, 0, sizeof(hc));
+    hc.id = c->fd;
+    hc.ipaddr = c->ipaddr.s_addr;
+    hc.flags = (c->name_registered ? HCLIENT_REGISTERED : 0) | (c->binary ? HCLIENT_BINARY : 0) | (c->waiting ? HCLIENT_WAITING : 0) |
+               (c->buffering_input ? HCLIENT_BUFFERING : 0) | (c->discarding ? HCLIENT_DISCARDING : 0) | (c->watch_prompt ? HCLIENT_WATCH_PROMPT : 0);
+    hc.rating = c->rating;
+    hc.rated_matches = c->rated_matches;
+    hc.last_opponent = c->client_just_played ? c->client_just_played->fd : -1;
+    hc.watching = c->watching ? c->watching->players[0]->fd : -1;
+    hc.deadline_ms = timer_left_ms(&c->deadline);
+    hc.idle_ms = (timer_now - c->last_input) * TIMER_TICK_MS;
+    hc.name_len = strlen(c->name);
+    hc.in_len = c->bufferinfo ? c->bufferinfo->tail - c->bufferinfo->head : 0;
+    hc.out_len = c->outq_bytes;
+    hc.waited_ns = c->waiting ? nowns() - c->wait_since : 0;
+
+    r.type = HREC_CLIENT;
+    r.len = sizeof(hc) + hc.name_len + hc.in_len + hc.out_len;
+    handoff_append(&r, sizeof(r));
+    handoff_append(&hc, sizeof(hc));
+    handoff_append(c->name, hc.name_len);
+
+    //the unhandled input may wrap around the end of the ring
+    if (hc.in_len > 0) {
+        unsigned int start = c->bufferinfo->head & (INPUT_RING_LEN - 1);
+        unsigned int first = INPUT_RING_LEN - start < hc.in_len ? INPUT_RING_LEN - start : hc.in_len;
+
+        handoff_append(c->bufferinfo->ring + start, first);
+        handoff_append(c->bufferinfo->ring, hc.in_len - first);
+    }
+
+    for (chunk = c->outq_head; chunk; chunk = chunk->next) {
+        handoff_append(chunk->msg->data + chunk->off, chunk->msg->len - chunk->off);
+    }
+
+    handoff_addfd(c->fd);
+}
+
+/*
+Saves match for the new server, which has its players by then
+*/
+void handoff_savematch(struct match *match) {
+    struct handoff_match hm;
+    struct handoff_record r;
+    int i;
+
+    memset(&hm, 0, sizeof(hm));
+    for (i = 0; i < 2; i++) {
+        struct player_info *info = match->players[i]->player_info;
+
+        hm.players[i] = match->players[i]->fd;
+        hm.hp[i] = info->hp;
+        hm.powermoves_remaining[i] = info->powermoves_remaining;
+        hm.hp_regens_remaining[i] = info->hp_regens_remaining;
+    }
+    hm.starting_player = match->starting_player == match->players[1];
+    hm.active_player = match->active_player == match->players[1];
+    hm.speech_state = match->speech_state;
+    hm.round = match->round;
+    hm.powermove_count = match->powermove_count;
+    hm.hp_regen_count = match->hp_regen_count;
+    hm.turn_ms = timer_left_ms(&match->turn_timer);
+    hm.seed = match->seed;
+    memcpy(hm.rng, match->rng.s, sizeof(hm.rng));
+
+    r.type = HREC_MATCH;
+    r.len = sizeof(hm);
+    handoff_append(&r, sizeof(r));
+    handoff_append(&hm, sizeof(hm));
+}
+
+/*
+Saves this worker's listening socket, clients and matches for the new server. Called on the way out of runworker,
+and waits there for every other worker, since mail may still be on its way until they have all stopped
+*/
+void handoff_save() {
+    struct handoff_worker hw;
+    struct handoff_record r;
+    struct client *c;
+
+    pthread_barrier_wait(&handoff_barrier);
+
+    //nobody sends mail anymore, so this is the last of it (e.g. a waiting client another worker just handed over)
+    if (shard->wakefd[0] != -1) {
+        handlemail();
+    }
+
+    //get out whatever the sockets take now, and drop the clients that went away meanwhile
+    flushstreams();
+    flushpending();
+    while (close_list) {
+        reapclients();
+        flushpending();
+    }
+
+    hw.seed_source = seed_source;
+    r.type = HREC_WORKER;
+    r.len = sizeof(hw);
+    handoff_append(&r, sizeof(r));
+    handoff_append(&hw, sizeof(hw));
+    handoff_addfd(shard->listenfd);
+
+    //waiting clients first, so the new worker queues them in the same order
+    for (c = wait_head; c; c = c->wait_next) {
+        handoff_saveclient(c);
+    }
+
+    for (c = top; c; c = c->next) {
+        if (!c->waiting) {
+            handoff_saveclient(c);
+        }
+    }
+
+    for (c = top; c; c = c->next) {
+        if (c->in_match && c == c->current_match->players[0]) {
+            handoff_savematch(c->current_match);
+        }
+    }
+}
+
+/*
+Sends the new server what every worker saved (see handoff.h), with the sockets that go with it, and closes them here.
+Called by main once every worker has stopped
+*/
+void handoff_send() {
+    struct handoff_header h;
+    struct handoff_record end = {HREC_END, 0};
+    size_t len = sizeof(h) + sizeof(end);
+    int nfds = 0;
+    int i;
+
+    memcpy(h.magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN);
+    h.workers = worker_count;
+    h.port = listen_port;
+
+    for (i = 0; i < worker_count; i++) {
+        len += shards[i].handoff_len;
+        nfds += shards[i].handoff_nfds;
+    }
+
+    char *data = malloc(len);
+    int *fds = malloc(nfds * sizeof(int));
+    if (!data || !fds) {
+        perror("malloc");
+        exit(1);
+    }
+
+    size_t off = 0;
+    int fd_off = 0;
+
+    memcpy(data, &h, sizeof(h));
+    off += sizeof(h);
+    for (i = 0; i < worker_count; i++) {
+        memcpy(data + off, shards[i].handoff_data, shards[i].handoff_len);
+        off += shards[i].handoff_len;
+        memcpy(fds + fd_off, shards[i].handoff_fds, shards[i].handoff_nfds * sizeof(int));
+        fd_off += shards[i].handoff_nfds;
+
+        free(shards[i].handoff_data);
+        free(shards[i].handoff_fds);
+    }
+    memcpy(data + off, &end, sizeof(end));
+
+    //the new server reads everything before it looks at any of it, so a batch of descriptors can ride along with any
+    //bytes, as long as every batch gets some
+    off = 0;
+    fd_off = 0;
+    while (off < len) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        } ctl;
+        struct msghdr msg;
+        struct iovec iov;
+        int batch = nfds - fd_off < HANDOFF_MAX_FDS ? nfds - fd_off : HANDOFF_MAX_FDS;
+        size_t chunk = len - off < HANDOFF_CHUNK_LEN ? len - off : HANDOFF_CHUNK_LEN;
+        size_t later = (nfds - fd_off - batch + HANDOFF_MAX_FDS - 1) / HANDOFF_MAX_FDS;
+
+        if (len - off - chunk < later) {
+            chunk = len - off - later;
+        }
+
+        iov.iov_base = data + off;
+        iov.iov_len = chunk;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (batch > 0) {
+            msg.msg_control = ctl.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+
+            struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type = SCM_RIGHTS;
+            cm->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+            memcpy(CMSG_DATA(cm), fds + fd_off, sizeof(int) * batch);
+        }
+
+        ssize_t sent = sendmsg(takeover_conn, &msg, 0);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("handoff");
+            break;
+        }
+
+        //a short send still took the whole batch of descriptors along
+        off += sent;
+        fd_off += batch;
+    }
+
+    if (off == len) {
+        printf("Handed %d connections over to the new server\n", nfds - worker_count);
+    }
+    else {
+        fprintf(stderr, "Handoff failed, %d connections are lost\n", nfds - worker_count);
+    }
+
+    close(takeover_conn);
+    for (i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    free(data);
+    free(fds);
+}
+
+/*
+Connects to the handoff socket at path and receives everything the old server hands over (see handoff.h). The new
+server runs as many workers as the old one had, on its port.
+returns 0 on success and -1 on error
+*/
+int takeover(const char *path) {
+    struct sockaddr_un addr;
+    struct handoff_header h;
+    struct handoff_record r;
+    size_t cap = 0;
+    int fds_cap = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Handoff socket path is too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    //the old server sends everything, then hangs up
+    for (;;) {
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        } ctl;
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cm;
+
+        if (cap - takeover_len < HANDOFF_CHUNK_LEN) {
+            cap = cap ? cap * 2 : 4 * HANDOFF_CHUNK_LEN;
+            if (!(takeover_data = realloc(takeover_data, cap))) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        iov.iov_base = takeover_data + takeover_len;
+        iov.iov_len = cap - takeover_len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("takeover");
+            close(fd);
+            return -1;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+
+            int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (takeover_nfds + count > fds_cap) {
+                fds_cap = fds_cap ? fds_cap * 2 : HANDOFF_MAX_FDS;
+                while (fds_cap < takeover_nfds + count) {
+                    fds_cap *= 2;
+                }
+                if (!(takeover_fds = realloc(takeover_fds, fds_cap * sizeof(int)))) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            memcpy(takeover_fds + takeover_nfds, CMSG_DATA(cm), count * sizeof(int));
+            takeover_nfds += count;
+        }
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+            fprintf(stderr, "takeover: connections were lost on the way (out of file descriptors?)\n");
+            close(fd);
+            return -1;
+        }
+
+        if (n == 0) {
+            break;
+        }
+        takeover_len += n;
+    }
+    close(fd);
+
+    if (takeover_len < sizeof(h) || memcmp(takeover_data, HANDOFF_MAGIC, HANDOFF_MAGIC_LEN) != 0) {
+        fprintf(stderr, "takeover: %s did not hand anything over\n", path);
+        return -1;
+    }
+    memcpy(&h, takeover_data, sizeof(h));
+
+    //every record must be there, starting with the first worker's, and every descriptor the records take
+    size_t off = sizeof(h);
+    unsigned int workers = 0;
+    int needed = 0, ended = 0;
+
+    while (!ended && off + sizeof(r) <= takeover_len) {
+        memcpy(&r, takeover_data + off, sizeof(r));
+        if (r.len > takeover_len - off - sizeof(r) || (off == sizeof(h) && r.type != HREC_WORKER)) {
+            break;
+        }
+
+        workers += r.type == HREC_WORKER;
+        needed += r.type == HREC_WORKER || r.type == HREC_CLIENT;
+        ended = r.type == HREC_END;
+        off += sizeof(r) + r.len;
+    }
+
+    if (!ended || workers != h.workers || workers < 1 || workers > MAX_WORKERS || needed != takeover_nfds) {
+        fprintf(stderr, "takeover: %s handed over an incomplete state\n", path);
+        return -1;
+    }
+
+    if (worker_count != (int) workers) {
+        printf("Taking over %u workers (not %d)\n", workers, worker_count);
+    }
+    worker_count = workers;
+    listen_port = h.port;
+    takeover_off = sizeof(h);
+
+    printf("Took over %d connections from %s\n", takeover_nfds - worker_count, path);
+    return 0;
+}
+
+/*
+Gives worker s its share of what the old server handed over: its records, up to the next worker's, and the
+descriptors they take. Called for every worker in order.
+returns the worker's listening socket
+*/
+int handoff_claim(struct shard *s) {
+    struct handoff_record r;
+    size_t start = takeover_off;
+    int fd_start = takeover_fd_off;
+
+    do {
+        memcpy(&r, takeover_data + takeover_off, sizeof(r));
+        if (r.type == HREC_WORKER || r.type == HREC_CLIENT) {
+            takeover_fd_off++;
+        }
+        takeover_off += sizeof(r) + r.len;
+
+        memcpy(&r, takeover_data + takeover_off, sizeof(r));
+    } while (r.type != HREC_WORKER && r.type != HREC_END);
+
+    s->handoff_len = takeover_off - start;
+    s->handoff_nfds = takeover_fd_off - fd_start;
+    s->handoff_data = malloc(s->handoff_len);
+    s->handoff_fds = malloc(s->handoff_nfds * sizeof(int));
+    if (!s->handoff_data || !s->handoff_fds) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(s->handoff_data, takeover_data + start, s->handoff_len);
+    memcpy(s->handoff_fds, takeover_fds + fd_start, s->handoff_nfds * sizeof(int));
+
+    return s->handoff_fds[0];
+}
+
+/*
+Recreates the clients and matches the old server's worker had, from this worker's handoff records. Called when the
+worker starts, so its clients only see a pause
+*/
+void handoff_restore() {
+    struct client **byid = NULL; //clients by the id the old server knew them by
+    int byid_len = 0;
+    struct handoff_record r;
+    struct handoff_client hc;
+    struct handoff_match hm;
+    size_t off;
+    int next_fd = 0;
+    int clients = 0, matches = 0;
+    int i;
+
+    for (off = 0; off < shard->handoff_len; off += sizeof(r) + r.len) {
+        memcpy(&r, shard->handoff_data + off, sizeof(r));
+        const char *data = shard->handoff_data + off + sizeof(r);
+
+        if (r.type == HREC_WORKER) {
+            struct handoff_worker hw;
+            memcpy(&hw, data, sizeof(hw));
+            seed_source = hw.seed_source;
+            next_fd++;
+        }
+        else if (r.type == HREC_CLIENT) {
+            memcpy(&hc, data, sizeof(hc));
+            data += sizeof(hc);
+            int fd = shard->handoff_fds[next_fd++];
+
+            if (hc.id >= byid_len) {
+                int new_len = byid_len ? byid_len : 64;
+                while (new_len <= hc.id) {
+                    new_len *= 2;
+                }
+                if (!(byid = realloc(byid, new_len * sizeof(struct client *)))) {
+                    perror("realloc");
+                    exit(1);
+                }
+                memset(byid + byid_len, 0, (new_len - byid_len) * sizeof(struct client *));
+                byid_len = new_len;
+            }
+
+            if (setnonblocking(fd) == -1 || reactor_add(fd, REACTOR_READ | REACTOR_EDGE) == -1) {
+                close(fd);
+                continue;
+            }
+
+            struct in_addr addr;
+            addr.s_addr = hc.ipaddr;
+            struct client *c = addclient(fd, addr);
+            byid[hc.id] = c;
+            clients++;
+            __atomic_add_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+
+            c->binary = (hc.flags & HCLIENT_BINARY) != 0;
+            c->buffering_input = (hc.flags & HCLIENT_BUFFERING) != 0;
+            c->discarding = (hc.flags & HCLIENT_DISCARDING) != 0;
+            c->watch_prompt = (hc.flags & HCLIENT_WATCH_PROMPT) != 0;
+            c->rating = hc.rating; //before enqueuewaiting, which indexes c by it
+            c->rated_matches = hc.rated_matches;
+
+            unsigned long idle_ticks = hc.idle_ms / TIMER_TICK_MS;
+            c->last_input = timer_now > idle_ticks ? timer_now - idle_ticks : 0;
+
+            if (hc.flags & HCLIENT_REGISTERED) {
+                char name[MAX_NAME_LEN];
+                size_t len = hc.name_len < MAX_NAME_LEN ? hc.name_len : MAX_NAME_LEN - 1;
+                memcpy(name, data, len);
+                name[len] = '\0';
+
+                pthread_mutex_lock(&name_index_lock);
+                c->name = nameindex_insert(name);
+                pthread_mutex_unlock(&name_index_lock);
+                c->name_registered = 1;
+
+                if (profile_fd != -1) {
+                    pthread_mutex_lock(&profile_lock);
+                    c->profile = profile_find(name);
+                    pthread_mutex_unlock(&profile_lock);
+                }
+            }
+            data += hc.name_len;
+
+            if (hc.in_len > 0 && hc.in_len <= INPUT_RING_LEN) {
+                c->bufferinfo = pool_alloc(&bufferinfo_pool);
+                c->bufferinfo->head = 0;
+                c->bufferinfo->tail = hc.in_len;
+                memcpy(c->bufferinfo->ring, data, hc.in_len);
+            }
+            data += hc.in_len;
+
+            queueoutput(c, data, hc.out_len);
+
+            if (hc.flags & HCLIENT_WAITING) {
+                enqueuewaiting(c);
+                c->wait_since = nowns() - hc.waited_ns; //time spent waiting on the old server counts too
+            }
+
+            timer_cancel(&c->deadline);
+            if (hc.deadline_ms > 0) {
+                timer_arm(&c->deadline, hc.deadline_ms);
+            }
+        }
+        else if (r.type == HREC_MATCH) {
+            memcpy(&hm, data, sizeof(hm));
+            struct client *p0 = hm.players[0] < byid_len ? byid[hm.players[0]] : NULL;
+            struct client *p1 = hm.players[1] < byid_len ? byid[hm.players[1]] : NULL;
+
+            if (!p0 || !p1) {
+                //one player's connection didn't make it, which is as good as a drop
+                struct client *c = p0 ? p0 : p1;
+                if (c) {
+                    tellresult(c, RESULT_OPPONENT_DROPPED, "--Opponent dropped. You win!\n");
+                    tellclient(c, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+                    enqueuewaiting(c);
+                }
+                continue;
+            }
+
+            struct match *match = pool_alloc(&match_pool);
+            timer_init(&match->turn_timer, turntimeout, match);
+            match->seed = hm.seed;
+            memcpy(match->rng.s, hm.rng, sizeof(hm.rng));
+
+            match->players[0] = p0;
+            match->players[1] = p1;
+            match->starting_player = match->players[hm.starting_player];
+            match->active_player = match->players[hm.active_player];
+            match->non_active_player = match->players[!hm.active_player];
+            match->round = hm.round;
+            match->speech_state = hm.speech_state;
+            match->powermove_count = hm.powermove_count;
+            match->hp_regen_count = hm.hp_regen_count;
+            match->spectators = NULL;
+            match->text_spectators = 0;
+            match->binary_spectators = 0;
+            match->stream_text = NULL;
+            match->stream_binary = NULL;
+            match->stream_next = NULL;
+            match->stream_prev = NULL;
+
+            for (i = 0; i < 2; i++) {
+                struct client *c = match->players[i];
+                c->in_match = 1;
+                c->current_match = match;
+                c->player_info = pool_alloc(&player_info_pool);
+                c->player_info->hp = hm.hp[i];
+                c->player_info->powermoves_remaining = hm.powermoves_remaining[i];
+                c->player_info->hp_regens_remaining = hm.hp_regens_remaining[i];
+            }
+
+            if (hm.turn_ms > 0) {
+                timer_arm(&match->turn_timer, hm.turn_ms);
+            }
+            linkmatch(match);
+            matches++;
+        }
+    }
+
+    //every client and match exists now, so link last opponents and spectators
+    for (off = 0; off < shard->handoff_len; off += sizeof(r) + r.len) {
+        memcpy(&r, shard->handoff_data + off, sizeof(r));
+        if (r.type != HREC_CLIENT) {
+            continue;
+        }
+
+        memcpy(&hc, shard->handoff_data + off + sizeof(r), sizeof(hc));
+        struct client *c = byid[hc.id];
+        struct client *opp = hc.last_opponent >= 0 && hc.last_opponent < byid_len ? byid[hc.last_opponent] : NULL;
+        struct client *p0 = hc.watching >= 0 && hc.watching < byid_len ? byid[hc.watching] : NULL;
+
+        if (!c) {
+            continue;
+        }
+
+        if (opp && !c->client_just_played && !opp->client_just_played) {
+            c->client_just_played = opp;
+            opp->client_just_played = c;
+        }
+
+        //a spectator whose match didn't make it goes back to looking for an opponent
+        if (p0 && p0->in_match) {
+            linkspectator(c, p0->current_match);
+        }
+        else if (hc.watching >= 0) {
+            enqueuewaiting(c);
+        }
+    }
+
+    LOG(LOG_INFO, "Worker %d took over %d clients and %d matches", shard->id, clients, matches);
+
+    //empty again, for the next restart
+    free(byid);
+    free(shard->handoff_data);
+    free(shard->handoff_fds);
+    shard->handoff_data = NULL;
+    shard->handoff_len = 0;
+    shard->handoff_fds = NULL;
+    shard->handoff_nfds = 0;
+
+    matchloneclients();
+}
+
+/*
+returns the current time in timer ticks
+*/
+static unsigned long timer_tick() {
+    return (nowns() - server_start_ns) / (TIMER_TICK_MS * 1000000UL);
+}
+
+/*
+Starts this worker's timer wheel at the current tick, with every slot empty
+*/
+void timer_start() {
+    int level, slot;
+
+    timer_now = timer_tick();
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        for (slot = 0; slot < (1 << TIMER_BITS); slot++) {
+            timer_wheel[level][slot].next = &timer_wheel[level][slot];
+            timer_wheel[level][slot].prev = &timer_wheel[level][slot];
+        }
+    }
+}
+
+/*
+Sets up timer t, which calls fire(owner) when it runs out. t starts disarmed
+*/
+void timer_init(struct timer *t, void (*fire)(void *owner), void *owner) {
+    t->next = NULL;
+    t->prev = NULL;
+    t->fire = fire;
+    t->owner = owner;
+}
+
+/*
+Puts armed timer t in the wheel slot for its expiry: the lowest level whose range still covers it
+*/
+static void timer_insert(struct timer *t) {
+    unsigned long delta = t->expires > timer_now ? t->expires - timer_now : 0;
+    unsigned long max = (1UL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    int level = 0;
+
+    if (delta > max) {
+        t->expires = timer_now + max;
+        delta = max;
+    }
+
+    while (level < TIMER_LEVELS - 1 && delta >= (1UL << (TIMER_BITS * (level + 1)))) {
+        level++;
+    }
+
+    struct timer *head = &timer_wheel[level][(t->expires >> (TIMER_BITS * level)) & ((1 << TIMER_BITS) - 1)];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void timer_unlink(struct timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+}
+
+/*
+(Re)arms timer t to run out ms milliseconds from now. O(1)
+*/
+void timer_arm(struct timer *t, unsigned long ms) {
+    if (t->next) {
+        timer_unlink(t);
+    }
+    else {
+        timer_count++;
+    }
+
+    //timer_now lags behind the clock while the worker sleeps, so count from the clock.
+    //never in the slot being run right now, so a timer rearmed by its own callback waits at least a tick
+    unsigned long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    unsigned long now = timer_tick();
+    t->expires = (now > timer_now ? now : timer_now) + (ticks ? ticks : 1);
+    timer_insert(t);
+}
+
+/*
+Disarms timer t, if it is armed. O(1)
+*/
+void timer_cancel(struct timer *t) {
+    if (t->next) {
+        timer_unlink(t);
+        timer_count--;
+    }
+}
+
+/*
+returns how many milliseconds timer t has left, or 0 if it is not armed
+*/
+unsigned long timer_left_ms(struct timer *t) {
+    if (!t->next) {
+        return 0;
+    }
+
+    unsigned long now = timer_tick();
+    return t->expires > now ? (t->expires - now) * TIMER_TICK_MS : 1;
+}
+
+/*
+Moves every timer in a higher-level slot down to the level that now covers it
+*/
+static void timer_cascade(int level, int slot) {
+    struct timer *head = &timer_wheel[level][slot];
+
+    while (head->next != head) {
+        struct timer *t = head->next;
+        timer_unlink(t);
+        timer_insert(t);
+    }
+}
+
+/*
+Runs every timer that has come due, one tick at a time up to the current time
+*/
+void timer_run() {
+    unsigned long now = timer_tick();
+
+    while (timer_now < now) {
+        timer_now++;
+
+        //when the lower levels wrap around, the next slot of the level above them comes into range.
+        //cascade from the highest such level down, so its timers end up in the right lower slots
+        int top_level = 0;
+        while (top_level < TIMER_LEVELS - 1 && (timer_now & ((1UL << (TIMER_BITS * (top_level + 1))) - 1)) == 0) {
+            top_level++;
+        }
+
+        int level;
+        for (level = top_level; level >= 1; level--) {
+            timer_cascade(level, (timer_now >> (TIMER_BITS * level)) & ((1 << TIMER_BITS) - 1));
+        }
+
+        //a callback may arm or cancel other timers, including ones in this slot, so take them one at a time
+        struct timer *head = &timer_wheel[0][timer_now & ((1 << TIMER_BITS) - 1)];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            timer_unlink(t);
+            timer_count--;
+            t->fire(t->owner);
+        }
+    }
+}
+
+/*
+returns how long reactor_wait may sleep before the next tick is due, or -1 when no timer is armed
+*/
+int timer_wait_ms() {
+    if (timer_count == 0) {
+        return -1;
+    }
+
+    unsigned long elapsed = (nowns() - server_start_ns) / 1000000UL;
+    unsigned long next_tick = (timer_now + 1) * TIMER_TICK_MS;
+
+    return next_tick > elapsed ? (int) (next_tick - elapsed) : 0;
+}
+
+/*
+Arms client c's deadline for what c is expected to do next: send its name, or (once registered) anything at all
+*/
+void resetdeadline(struct client *c) {
+    timer_cancel(&c->deadline);
+
+    if (!c->name_registered && register_timeout > 0) {
+        timer_arm(&c->deadline, register_timeout * 1000UL);
+    }
+    else if (c->name_registered && idle_timeout > 0) {
+        timer_arm(&c->deadline, idle_timeout * 1000UL);
+    }
+}
+
+/*
+Client c's deadline ran out. Input doesn't touch the timer (it only records last_input),
+so an idle deadline that finds recent input just rearms for the rest of the period
+*/
+void clientdeadline(void *owner) {
+    struct client *c = owner;
+
+    if (c->closing) {
+        return;
+    }
+
+    if (!c->name_registered) {
+        LOG(LOG_INFO, "%s took too long to register, disconnecting", inet_ntoa(c->ipaddr));
+        broadcast_to_client(c, "\nToo slow, goodbye.\n");
+        flushclient(c); //best effort: closing clients are never flushed
+        STAT_ADD(shard->metrics.evictions, 1);
+        markclosing(c);
+        return;
+    }
+
+    unsigned long idle_ticks = (unsigned long) idle_timeout * 1000 / TIMER_TICK_MS;
+    unsigned long quiet = timer_now - c->last_input;
+
+    //in a match, the turn timer is what keeps things moving. spectators are quiet by nature
+    int busy = c->in_match || c->watching;
+    if (busy || quiet < idle_ticks) {
+        timer_arm(&c->deadline, (busy ? idle_ticks : idle_ticks - quiet) * TIMER_TICK_MS);
+        return;
+    }
+
+    LOG(LOG_INFO, "%s has been idle for %d seconds, disconnecting", c->name, idle_timeout);
+    broadcast_to_client(c, "\nYou have been idle for too long, goodbye.\n");
+    flushclient(c); //best effort: closing clients are never flushed
+    STAT_ADD(shard->metrics.evictions, 1);
+    markclosing(c);
+}
+
+/*
+The active player of match took too long: attack for them, or make them forfeit (--turn-forfeit)
+*/
+void turntimeout(void *owner) {
+    struct match *match = owner;
+    struct client *p = match->active_player;
+
+    if (p->closing || match->non_active_player->closing) {
+        return; //the match ends when the client is removed
+    }
+
+    STAT_ADD(shard->metrics.turn_timeouts, 1);
+    broadcast_to_client(p, "\nYou ran out of time!\n");
+
+    if (journal_fd != -1) {
+        journal_timeout(match);
+    }
+
+    //whatever they were typing is abandoned, up to the end of the line, so the rest of it isn't read as moves
+    if (match->speech_state && !p->binary) {
+        p->discarding = 1;
+    }
+    match->speech_state = 0;
+
+    if (!turn_forfeit) {
+        handlecommand(p, 'a');
+        return;
+    }
+
+    match->winner = match->non_active_player;
+    match->loser = p;
+
+    tellresult(match->winner, RESULT_WIN, "Your opponent ran out of time. You win!\n");
+    tellresult(match->loser, RESULT_LOSS, "You forfeit the match. You lose!\n");
+
+    tellclient(match->winner, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+    tellclient(match->loser, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+
+    if (journal_fd != -1) {
+        journal_end(match, JEND_FORFEIT);
+    }
+
+    endmatch(match, END_FORFEIT);
+}
+
+/*
+Opens (or creates) the match journal at path for appending
+returns the fd, or -1 on error
+*/
+int journal_open(const char *path) {
+    char magic[JOURNAL_MAGIC_LEN];
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        if (write(fd, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != JOURNAL_MAGIC_LEN) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    else if (pread(fd, magic, JOURNAL_MAGIC_LEN, 0) != JOURNAL_MAGIC_LEN || memcmp(magic, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not a match journal\n", path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+The journal thread: writes queued buffers out in order, as many per writev as there are, until journal_stop
+*/
+void *journalwriter(void *arg) {
+    struct iovec iov[MAX_IOV];
+    int failed = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock(&journal_lock);
+    for (;;) {
+        while (!journal_head && !journal_stopping) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
+        }
+        if (!journal_head) {
+            break; //stopping, and everything is written
+        }
+
+        //take up to MAX_IOV buffers, and write them without holding the lock
+        struct journal_buf *batch = journal_head;
+        struct journal_buf *last = batch;
+        int n = 1;
+        while (last->next && n < MAX_IOV) {
+            last = last->next;
+            n++;
+        }
+        journal_head = last->next;
+        if (!journal_head) {
+            journal_tail = NULL;
+        }
+        journal_queued -= n;
+        last->next = NULL;
+        pthread_mutex_unlock(&journal_lock);
+
+        struct journal_buf *b;
+        int i = 0;
+        for (b = batch; b; b = b->next) {
+            iov[i].iov_base = b->data;
+            iov[i].iov_len = b->len;
+            i++;
+        }
+
+        //O_APPEND, so a short write just continues where it stopped
+        struct iovec *v = iov;
+        while (n > 0 && !failed) {
+            ssize_t written = writev(journal_fd, v, n);
+
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("journal");
+                failed = 1; //keep draining the queue so workers aren't held up, but stop writing
+                break;
+            }
+
+            while (n > 0 && (size_t) written >= v->iov_len) {
+                written -= v->iov_len;
+                v++;
+                n--;
+            }
+            if (n > 0) {
+                v->iov_base = (char *) v->iov_base + written;
+                v->iov_len -= written;
+            }
+        }
+
+        pthread_mutex_lock(&journal_lock);
+        last->next = journal_free;
+        journal_free = batch;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return NULL;
+}
+
+/*
+Lets the journal thread write out what is queued, waits for it, and closes the journal
+*/
+void journal_stop() {
+    pthread_mutex_lock(&journal_lock);
+    journal_stopping = 1;
+    pthread_cond_signal(&journal_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    pthread_join(journal_thread, NULL);
+
+    while (journal_free) {
+        struct journal_buf *b = journal_free;
+        journal_free = b->next;
+        free(b);
+    }
+
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+/*
+Appends a record of the given type about match to this worker's journal buffer, with len bytes of payload
+returns the payload, for the caller to fill in. Padding is zeroed
+*/
+void *journal_reserve(struct match *match, int type, int actor, size_t len) {
+    size_t size = (sizeof(struct journal_record) + len + JOURNAL_ALIGN - 1) & ~(size_t) (JOURNAL_ALIGN - 1);
+    struct timespec ts;
+
+    if (journal_cur && journal_cur->len + size > JOURNAL_BUF_LEN) {
+        journal_submit();
+    }
+
+    if (!journal_cur) {
+        pthread_mutex_lock(&journal_lock);
+        journal_cur = journal_free;
+        if (journal_cur) {
+            journal_free = journal_cur->next;
+        }
+        pthread_mutex_unlock(&journal_lock);
+
+        if (!journal_cur && !(journal_cur = malloc(sizeof(struct journal_buf)))) {
+            perror("malloc");
+            exit(1);
+        }
+        journal_cur->next = NULL;
+        journal_cur->len = 0;
+        journal_cur->records = 0;
+
+        //an idle worker still gets its records out soon
+        timer_arm(&journal_timer, JOURNAL_FLUSH_MS);
+    }
+
+    struct journal_record *r = (struct journal_record *) (journal_cur->data + journal_cur->len);
+    memset(r, 0, size);
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    r->len = size;
+    r->type = type;
+    r->actor = actor;
+    r->round = match->round;
+    r->match_id = match->seed;
+    r->time_ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    journal_cur->len += size;
+    journal_cur->records++;
+    STAT_ADD(shard->metrics.journal_records, 1);
+
+    return r + 1;
+}
+
+/*
+Hands this worker's journal buffer to the journal thread. Never waits for the disk: if the thread is too far
+behind, the buffer is dropped (and counted) instead
+*/
+void journal_submit() {
+    struct journal_buf *b = journal_cur;
+    journal_cur = NULL;
+    timer_cancel(&journal_timer);
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal_queued >= JOURNAL_MAX_QUEUED) {
+        STAT_ADD(shard->metrics.journal_dropped, b->records);
+        b->next = journal_free;
+        journal_free = b;
+    }
+    else {
+        if (journal_tail) {
+            journal_tail->next = b;
+        }
+        else {
+            journal_head = b;
+        }
+        journal_tail = b;
+        journal_queued++;
+        pthread_cond_signal(&journal_cond);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_flushtimer(void *owner) {
+    (void) owner;
+
+    if (journal_cur) {
+        journal_submit();
+    }
+}
+
+void journal_start(struct match *match) {
+    size_t len0 = strlen(match->players[0]->name);
+    size_t len1 = strlen(match->players[1]->name);
+    struct journal_start *js = journal_reserve(match, JREC_START, JACTOR_NONE, sizeof(*js) + len0 + len1);
+
+    js->hp[0] = match->players[0]->player_info->hp;
+    js->hp[1] = match->players[1]->player_info->hp;
+    js->powermoves = match->powermove_count;
+    js->regens = match->hp_regen_count;
+    js->starting_player = match->non_active_player == match->players[1]; //the opening switchturn hands it the first move
+    js->name_len[0] = len0;
+    js->name_len[1] = len1;
+    memcpy((char *) (js + 1), match->players[0]->name, len0);
+    memcpy((char *) (js + 1) + len0, match->players[1]->name, len1);
+}
+
+void journal_move(struct client *c, int move, int amount) {
+    struct match *match = c->current_match;
+    struct journal_move *jm = journal_reserve(match, JREC_MOVE, c == match->players[1], sizeof(*jm));
+
+    jm->move = move;
+    jm->amount = amount;
+    jm->hp[0] = match->players[0]->player_info->hp;
+    jm->hp[1] = match->players[1]->player_info->hp;
+}
+
+void journal_chat(struct client *c, const char *s) {
+    size_t len = strlen(s);
+    memcpy(journal_reserve(c->current_match, JREC_CHAT, c == c->current_match->players[1], len), s, len);
+}
+
+void journal_timeout(struct match *match) {
+    journal_reserve(match, JREC_TIMEOUT, match->active_player == match->players[1], 0);
+}
+
+void journal_end(struct match *match, int reason) {
+    struct journal_end *je = journal_reserve(match, JREC_END, JACTOR_NONE, sizeof(*je));
+
+    je->reason = reason;
+    je->winner = match->winner == match->players[1];
+}
+
+/*
+Loads the profile store at path into the profile index (creating the store if there is none), and rewrites it with
+one record per profile. returns the store opened for appending, or -1
+*/
+int profile_open(const char *path) {
+    char tmp[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) != -1) {
+        if (fstat(fd, &st) == -1) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+
+        char *data = malloc(st.st_size ? st.st_size : 1);
+        if (!data) {
+            perror("malloc");
+            exit(1);
+        }
+
+        off_t done = 0;
+        while (done < st.st_size) {
+            ssize_t n = read(fd, data + done, st.st_size - done);
+            if (n <= 0) {
+                perror(path);
+                free(data);
+                close(fd);
+                return -1;
+            }
+            done += n;
+        }
+        close(fd);
+
+        if (st.st_size < PROFILE_MAGIC_LEN || memcmp(data, PROFILE_MAGIC, PROFILE_MAGIC_LEN) != 0) {
+            fprintf(stderr, "%s is not a profile store\n", path);
+            free(data);
+            return -1;
+        }
+
+        //later records replace earlier ones. a record cut short by a crash is left out
+        size_t off;
+        for (off = PROFILE_MAGIC_LEN; off + sizeof(struct profile_record) <= (size_t) st.st_size; off += sizeof(struct profile_record)) {
+            struct profile_record r;
+            memcpy(&r, data + off, sizeof(r));
+            r.name[MAX_NAME_LEN - 1] = '\0';
+
+            struct profile *p = profile_find(r.name);
+            if (!p) {
+                p = profile_insert(r.name);
+            }
+            p->rec = r;
+        }
+        if (off != (size_t) st.st_size) {
+            fprintf(stderr, "%s: ignoring %zu bytes of an unfinished record at the end\n", path, (size_t) st.st_size - off);
+        }
+        free(data);
+    }
+    else if (errno != ENOENT) {
+        perror(path);
+        return -1;
+    }
+
+    //compact: write every profile once to a new file, and swap it in
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(tmp);
+        return -1;
+    }
+
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        perror(tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    unsigned int i;
+    fwrite(PROFILE_MAGIC, 1, PROFILE_MAGIC_LEN, f);
+    for (i = 0; i < profile_index_slots; i++) {
+        if (profile_index[i].profile) {
+            fwrite(&profile_index[i].profile->rec, sizeof(struct profile_record), 1, f);
+        }
+    }
+
+    //the stream is gone after fclose, even when it fails. the old store stays as it was unless everything worked
+    if (fflush(f) != 0 || ferror(f) || fsync(fd) == -1) {
+        perror(tmp);
+        fclose(f);
+        unlink(tmp);
+        return -1;
+    }
+    if (fclose(f) != 0) {
+        perror(tmp);
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) == -1) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_APPEND)) == -1) {
+        perror(path);
+        return -1;
+    }
+
+    printf("Profiles: %u loaded from %s\n", profile_count, path);
+    return fd;
+}
+
+/*
+The profile writer: every PROFILE_FLUSH_MS, takes the dirty profiles, appends them to the store and syncs it.
+Workers never wait for it, they only need profile_lock for as long as copying the dirty records takes
+*/
+void *profilewriter(void *arg) {
+    struct profile_record *batch = NULL;
+    size_t batch_cap = 0;
+    int failed = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock(&profile_lock);
+    for (;;) {
+        //let changes collect, unless it is time to write the last of them
+        if (!profile_stopping) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += PROFILE_FLUSH_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+
+            while (!profile_stopping && pthread_cond_timedwait(&profile_cond, &profile_lock, &ts) != ETIMEDOUT);
+        }
+        int stopping = profile_stopping;
+
+        //copy the dirty profiles, then write them without holding the lock
+        size_t n = 0;
+        struct profile *p;
+        for (p = profile_dirty; p; p = p->dirty_next) {
+            if (n == batch_cap) {
+                batch_cap = batch_cap ? batch_cap * 2 : 256;
+                if (!(batch = realloc(batch, batch_cap * sizeof(struct profile_record)))) {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+            batch[n++] = p->rec;
+            p->dirty = 0;
+        }
+        profile_dirty = NULL;
+        pthread_mutex_unlock(&profile_lock);
+
+        if (n > 0 && !failed) {
+            unsigned long start = nowns();
+            const char *data = (const char *) batch;
+            size_t left = n * sizeof(struct profile_record);
+
+            //O_APPEND, so a short write just continues where it stopped
+            while (left > 0) {
+                ssize_t written = write(profile_fd, data, left);
+                if (written == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;
+                }
+                data += written;
+                left -= written;
+            }
+
+            if (left > 0 || fdatasync(profile_fd) == -1) {
+                perror("profiles");
+                failed = 1; //the profiles stay right in memory, but stop touching the store
+            }
+            else {
+                STAT_ADD(profile_writes, n);
+                STAT_ADD(profile_syncs, 1);
+                recordtime(&profile_sync_time, nowns() - start);
+            }
+        }
+
+        pthread_mutex_lock(&profile_lock);
+        if (stopping) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    free(batch);
+    return NULL;
+}
+
+/*
+Has the profile writer write out the last changes, waits for it, and closes the store
+*/
+void profile_stop() {
+    pthread_mutex_lock(&profile_lock);
+    profile_stopping = 1;
+    pthread_cond_signal(&profile_cond);
+    pthread_mutex_unlock(&profile_lock);
+
+    pthread_join(profile_thread, NULL);
+
+    close(profile_fd);
+    profile_fd = -1;
+}
+
+/*
+Returns name's profile, or NULL if it has none. Callers hold profile_lock (or run before the workers start)
+*/
+struct profile *profile_find(const char *name) {
+    if (profile_count == 0) {
+        return NULL;
+    }
+
+    unsigned int mask = profile_index_slots - 1;
+    unsigned int h = hashname(name);
+    unsigned int i;
+
+    for (i = h & mask; profile_index[i].profile; i = (i + 1) & mask) {
+        if (profile_index[i].hash == h && strcmp(profile_index[i].profile->rec.name, name) == 0) {
+            return profile_index[i].profile;
+        }
+    }
+    return NULL;
+}
+
+/*
+Creates a profile for name, which must not have one yet, with a new player's rating. Callers hold profile_lock
+*/
+struct profile *profile_insert(const char *name) {
+    //keep the load factor at or below 1/2 so probe sequences stay short
+    if ((profile_count + 1) * 2 > profile_index_slots) {
+        unsigned int old_slots = profile_index_slots;
+        struct profile_slot *old = profile_index;
+        unsigned int i, j;
+
+        profile_index_slots = old_slots ? old_slots * 2 : PROFILE_INDEX_MIN_SLOTS;
+        if (!(profile_index = calloc(profile_index_slots, sizeof(struct profile_slot)))) {
+            perror("calloc");
+            exit(1);
+        }
+
+        for (i = 0; i < old_slots; i++) {
+            if (old[i].profile) {
+                for (j = old[i].hash & (profile_index_slots - 1); profile_index[j].profile; j = (j + 1) & (profile_index_slots - 1));
+                profile_index[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct profile *p = calloc(1, sizeof(struct profile));
+    if (!p) {
+        perror("calloc");
+        exit(1);
+    }
+    snprintf(p->rec.name, sizeof(p->rec.name), "%s", name);
+    p->rec.rating = RATING_INITIAL;
+
+    unsigned int mask = profile_index_slots - 1;
+    unsigned int h = hashname(name);
+    unsigned int i;
+
+    for (i = h & mask; profile_index[i].profile; i = (i + 1) & mask);
+    profile_index[i].hash = h;
+    profile_index[i].profile = p;
+    STAT_SET(profile_count, profile_count + 1);
+
+    return p;
+}
+
+/*
+Puts profile p on the dirty list for the profile writer, if it isn't already. Callers hold profile_lock
+*/
+void profile_touch(struct profile *p) {
+    if (!p->dirty) {
+        p->dirty = 1;
+        p->dirty_next = profile_dirty;
+        profile_dirty = p;
+    }
+}
+
+/*
+Gives newly registered client c its stored rating, if it has a profile, and welcomes it back
+*/
+void profile_load(struct client *c) {
+    unsigned int wins = 0, losses = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    struct profile *p = profile_find(c->name);
+    if (p) {
+        c->profile = p;
+        c->rating = p->rec.rating;
+        wins = p->rec.wins;
+        losses = p->rec.losses;
+        c->rated_matches = wins + losses;
+        p->rec.last_seen = time(0);
+        profile_touch(p);
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    if (p) {
+        char s[MAX_MSG_LEN];
+        sprintf(s, "Welcome back! Rating %d, %u wins, %u losses\n", c->rating, wins, losses);
+        tellclient(c, MSG_TEXT, s, strlen(s), s);
+    }
+}
+
+/*
+Records a win (won is 1) or a loss for client c, with its new rating. A player's profile is created by their first match
+*/
+void profile_save(struct client *c, int won) {
+    pthread_mutex_lock(&profile_lock);
+    if (!c->profile) {
+        //the name is c's until it disconnects, so nobody else can have created this profile since c registered
+        c->profile = profile_insert(c->name);
+    }
+
+    struct profile *p = c->profile;
+    p->rec.rating = c->rating;
+    if (won) {
+        p->rec.wins++;
+    }
+    else {
+        p->rec.losses++;
+    }
+    p->rec.last_seen = time(0);
+    profile_touch(p);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+Records that client c, which has a profile, was around until now
+*/
+void profile_seen(struct client *c) {
+    pthread_mutex_lock(&profile_lock);
+    c->profile->rec.last_seen = time(0);
+    profile_touch(c->profile);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/*
+Logs a line at level (use LOG, which skips formatting lines below log_level). On a worker the line goes on its log
+ring for the log writer to print, so the event loop never blocks on stdout. Past log_rate lines in a second, lines
+other than errors are dropped, as they are when the ring is full
+*/
+void logline(int level, const char *fmt, ...) {
+    va_list ap;
+
+    if (!shard || !log_running) {
+        char text[LOG_LINE_LEN];
+        struct timespec ts;
+        int len;
+
+        va_start(ap, fmt);
+        len = vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        logprint(stdout, ts.tv_sec * 1000000000UL + ts.tv_nsec, level, text, len < (int) sizeof(text) ? len : (int) sizeof(text) - 1);
+        return;
+    }
+
+    unsigned long now = nowns();
+    if (now - log_window >= 1000000000UL) {
+        log_window = now;
+        log_window_lines = 0;
+    }
+    if (log_rate > 0 && log_window_lines >= log_rate && level > LOG_ERROR) {
+        STAT_ADD(shard->metrics.log_dropped, 1);
+        return;
+    }
+
+    struct log_ring *ring = shard->log;
+    unsigned long head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        STAT_ADD(shard->metrics.log_dropped, 1);
+        return;
+    }
+
+    struct log_slot *slot = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    struct timespec ts;
+    int len;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    slot->time_ns = ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    slot->level = level;
+    va_start(ap, fmt);
+    len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->len = len < (int) sizeof(slot->text) ? len : (int) sizeof(slot->text) - 1;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    log_window_lines++;
+}
+
+/*
+Writes a log line to out as "date time.millis LEVEL text". text need not end with a newline, one is added if not
+*/
+void logprint(FILE *out, unsigned long time_ns, int level, const char *text, int len) {
+    time_t secs = time_ns / 1000000000UL;
+    struct tm tm;
+    char when[32];
+
+    if (len > 0 && text[len - 1] == '\n') {
+        len--;
+    }
+    localtime_r(&secs, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s.%03lu %-5s %.*s\n", when, time_ns / 1000000UL % 1000, log_level_names[level], len, text);
+}
+
+/*
+The log thread: every LOG_FLUSH_MS prints what the workers have put on their log rings, and how many lines they
+dropped since, until log_stop
+*/
+void *logwriter(void *arg) {
+    unsigned long *reported = calloc(worker_count, sizeof(unsigned long));
+    struct timespec pause = {0, LOG_FLUSH_MS * 1000000L};
+    int i;
+
+    (void) arg;
+
+    for (;;) {
+        //read before draining, so lines logged before log_stop are printed
+        int stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+
+        for (i = 0; i < worker_count; i++) {
+            struct log_ring *ring = shards[i].log;
+            unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            unsigned long tail = ring->tail;
+
+            for (; tail != head; tail++) {
+                struct log_slot *slot = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+                logprint(stdout, slot->time_ns, slot->level, slot->text, slot->len);
+            }
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+            unsigned long dropped = STAT_GET(shards[i].metrics.log_dropped);
+            if (reported && dropped != reported[i]) {
+                printf("(worker %d dropped %lu log lines)\n", i, dropped - reported[i]);
+                reported[i] = dropped;
+            }
+        }
+        fflush(stdout);
+
+        if (stopping) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    free(reported);
+    return NULL;
+}
+
+/*
+Lets the log thread print what is on the log rings and waits for it. Later lines are printed directly
+*/
+void log_stop() {
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(log_thread, NULL);
+    log_running = 0;
+}
+
+/*
+Queues mail m for worker to, and wakes it up. NULL mail just wakes the worker (e.g. to notice shutdown)
+*/
+void sendmail(struct shard *to, struct mail *m) {
+    int wake;
+
+    pthread_mutex_lock(&to->lock);
+    if (m) {
+        m->next = NULL;
+        if (to->mail_tail) {
+            to->mail_tail->next = m;
+        }
+        else {
+            to->mail_head = m;
+        }
+        to->mail_tail = m;
+    }
+    wake = !to->woken;
+    to->woken = 1;
+    pthread_mutex_unlock(&to->lock);
+
+    if (wake && write(to->wakefd[1], "x", 1) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+/*
+Handles all mail sent to this worker since it last checked
+*/
+void handlemail() {
+    char buf[64];
+    while (read(shard->wakefd[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&shard->lock);
+    struct mail *m = shard->mail_head;
+    shard->mail_head = NULL;
+    shard->mail_tail = NULL;
+    shard->woken = 0;
+    pthread_mutex_unlock(&shard->lock);
+
+    while (m) {
+        struct mail *next = m->next;
+
+        if (m->type == MAIL_BROADCAST) {
+            broadcast_all(NULL, m->text, m->len);
+        }
+        else if (m->type == MAIL_HANDOFF) {
+            //adopt a waiting client from another worker. its name stays registered throughout
+            if (reactor_add(m->fd, REACTOR_READ | REACTOR_EDGE) == -1) {
+                pthread_mutex_lock(&name_index_lock);
+                nameindex_remove(m->name);
+                pthread_mutex_unlock(&name_index_lock);
+
+                __atomic_sub_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+                close(m->fd);
+            }
+            else {
+                struct client *c = addclient(m->fd, m->ipaddr);
+                c->name = m->name;
+                c->name_registered = 1;
+                c->binary = m->binary;
+                c->rating = m->rating; //before enqueuewaiting, which indexes c by it
+                c->rated_matches = m->rated_matches;
+                c->profile = m->profile;
+                resetdeadline(c);
+                enqueuewaiting(c);
+                c->wait_since = m->wait_since; //time spent waiting on the other worker counts too
+                matchclient(c);
+            }
+        }
+
+        free(m);
+        m = next;
+    }
+}
+
+/*
+Sends s to every registered client on every worker except sender
+*/
+void broadcast_arena(struct client *sender, char *s) {
+    int len = strlen(s);
+    int i;
+
+    broadcast_all(sender, s, len);
+
+    for (i = 0; i < worker_count; i++) {
+        if (i == shard->id) {
+            continue;
+        }
+
+        struct mail *m = malloc(sizeof(struct mail) + len + 1);
+        if (!m) {
+            perror("malloc");
+            exit(1);
+        }
+        m->type = MAIL_BROADCAST;
+        m->len = len;
+        memcpy(m->text, s, len + 1);
+
+        sendmail(&shards[i], m);
+    }
+}
+
+/*
+Cross-worker matchmaking. A worker left with exactly one waiting client advertises it. When a second worker ends up
+in the same position, it hands its waiter over to the advertising worker, which pairs the two locally.
+Must only be called when nothing refers to any client (i.e. at the end of an event loop iteration)
+*/
+void exchangelonewaiter() {
+    struct client *c = wait_head;
+    int target = -1;
+
+    //only a lone waiter with nothing buffered in either direction (or half typed), can move
+    int lone = (wait_count == 1 && !c->outq_head && !c->throttled && !c->bufferinfo && !c->watch_prompt);
+
+    if ((lone && advertised_client == c) || (!lone && !advertised_client)) {
+        return; //nothing changed since last time
+    }
+
+    pthread_mutex_lock(&exchange_lock);
+    if (!lone) {
+        if (exchange_shard == shard->id) {
+            exchange_shard = -1;
+        }
+    }
+    else if (exchange_shard == -1 || exchange_shard == shard->id) {
+        exchange_shard = shard->id;
+    }
+    else {
+        target = exchange_shard;
+        exchange_shard = -1;
+    }
+    pthread_mutex_unlock(&exchange_lock);
+
+    advertised_client = (lone && target == -1) ? c : NULL;
+
+    if (target != -1) {
+        handoffclient(c, target);
+    }
+}
+
+/*
+Moves waiting client c to worker target. The socket and the registered name go with it, everything else about c is released here
+*/
+void handoffclient(struct client *c, int target) {
+    struct mail *m = malloc(sizeof(struct mail));
+    if (!m) {
+        perror("malloc");
+        exit(1);
+    }
+    m->type = MAIL_HANDOFF;
+    m->fd = c->fd;
+    m->ipaddr = c->ipaddr;
+    m->name = c->name;
+    m->wait_since = c->wait_since;
+    m->binary = c->binary;
+    m->rating = c->rating;
+    m->rated_matches = c->rated_matches;
+    m->profile = c->profile;
+
+    //detach c from this worker without closing its socket or releasing its name
+    dequeuewaiting(c);
+    forgetlastopponent(c);
+    unlinkclient(c);
+    clients_by_fd[c->fd] = NULL;
+    reactor_del(c->fd);
+    timer_cancel(&c->deadline);
+    (*client_count)--;
+    STAT_SET(shard->metrics.clients, *client_count);
+
+    pool_free(&client_pool, c);
+
+    sendmail(&shards[target], m);
+}
+
+/*
+Reads as much as fits into client p's input ring without blocking, and handles every complete command or line in it.
+returns 0 if the ring filled up (so there may be more to read), 1 once the socket has been drained, and -1 if the client disconnected
+*/
+int handleclient(struct client *p) {
+    if (!p->bufferinfo) {
+        p->bufferinfo = pool_alloc(&bufferinfo_pool);
+        p->bufferinfo->head = 0;
+        p->bufferinfo->tail = 0;
+    }
+
+    struct bufferinfo *in = p->bufferinfo;
+    unsigned int used = in->tail - in->head;
+    unsigned int start = in->tail & (INPUT_RING_LEN - 1);
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    //free space may wrap around the end of the ring
+    iov[0].iov_base = in->ring + start;
+    iov[0].iov_len = INPUT_RING_LEN - used;
+    if (start + iov[0].iov_len > INPUT_RING_LEN) {
+        iov[0].iov_len = INPUT_RING_LEN - start;
+        iov[1].iov_base = in->ring;
+        iov[1].iov_len = (INPUT_RING_LEN - used) - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    size_t wanted = INPUT_RING_LEN - used;
+    ssize_t len = readv(p->fd, iov, iovcnt);
+    STAT_ADD(shard->metrics.syscalls, 1);
+    int result;
+
+    if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        result = 1;
+    }
+    else if (len == -1 && errno == EINTR) {
+        result = 0;
+    }
+    else if (len <= 0) {
+        // socket is closed, disconnect client
+        result = -1;
+    }
+    else {
+        LOG(LOG_TRACE, "Received %d bytes from %s", (int) len, p->name_registered ? p->name : inet_ntoa(p->ipaddr));
+        STAT_ADD(shard->metrics.bytes_in, len);
+
+        in->tail += len;
+        p->last_input = timer_now;
+        handleinput(p);
+
+        //a short read means the socket has been drained
+        result = ((size_t) len < wanted) ? 1 : 0;
+    }
+
+    //the ring goes back to the pool as soon as everything in it has been handled
+    if (in->head == in->tail) {
+        pool_free(&bufferinfo_pool, in);
+        p->bufferinfo = NULL;
+    }
+
+    return result;
+}
+
+/*
+Handles every complete command or line waiting in client p's input ring.
+Names and chat lines are read up to a newline, everything else is a single-byte command
+*/
+void handleinput(struct client *p) {
+    struct bufferinfo *in = p->bufferinfo;
+    char line[MAX_BUFFER_LEN + 1];
+
+    while (in->head != in->tail && !p->closing) {
+        if (p->binary) {
+            //length-prefixed frames (see protocol.h)
+            unsigned int pending = in->tail - in->head;
+            unsigned int i, len;
+
+            if (pending < 2) {
+                return;
+            }
+
+            len = ((unsigned char) in->ring[in->head & (INPUT_RING_LEN - 1)] << 8) | (unsigned char) in->ring[(in->head + 1) & (INPUT_RING_LEN - 1)];
+            if (len == 0 || len > MAX_BUFFER_LEN) {
+                LOG(LOG_WARN, "Bad frame length %u from %s", len, inet_ntoa(p->ipaddr));
+                markclosing(p);
+                return;
+            }
+
+            if (pending < 2 + len) {
+                //incomplete frame, wait for more input
+                return;
+            }
+
+            for (i = 0; i < len; i++) {
+                line[i] = in->ring[(in->head + 2 + i) & (INPUT_RING_LEN - 1)];
+            }
+            line[len] = '\0';
+            in->head += 2 + len;
+
+            handleframe(p, (unsigned char *) line, len);
+            continue;
+        }
+
+        if (p->discarding) {
+            //skip the rest of a line that was too long, whatever state the client is in now
+            char c = in->ring[in->head & (INPUT_RING_LEN - 1)];
+            in->head++;
+
+            if (c == '\n') {
+                p->discarding = 0;
+            }
+            continue;
+        }
+
+        //names (including the name of a player to watch), and chat from the active player, are read a line at a time
+        p->buffering_input = !p->name_registered || p->watch_prompt || (p->in_match && p->current_match->active_player == p && p->current_match->speech_state);
+
+        if (!p->buffering_input) {
+            char cmd = in->ring[in->head & (INPUT_RING_LEN - 1)];
+            in->head++;
+
+            handlecommand(p, cmd);
+            continue;
+        }
+
+        //look for the end of the line, but never further than a full line
+        unsigned int pending = in->tail - in->head;
+        unsigned int n;
+        int found = 0;
+
+        for (n = 0; n < pending && n < MAX_BUFFER_LEN - 1; n++) {
+            if (in->ring[(in->head + n) & (INPUT_RING_LEN - 1)] == '\n') {
+                found = 1;
+                break;
+            }
+        }
+
+        if (!found && n < MAX_BUFFER_LEN - 1) {
+            //incomplete line, wait for more input
+            return;
+        }
+
+        unsigned int i;
+        for (i = 0; i < n; i++) {
+            line[i] = in->ring[(in->head + i) & (INPUT_RING_LEN - 1)];
+        }
+        line[n] = '\0';
+        in->head += found ? n + 1 : n;
+
+        //telnet-style clients end lines with \r\n
+        if (n > 0 && line[n - 1] == '\r') {
+            line[n - 1] = '\0';
+        }
+
+        //a line longer than MAX_BUFFER_LEN is handled truncated, and the rest of it is skipped
+        p->discarding = !found;
+        handleline(p, line);
+    }
+}
+
+/*
+Handles a complete name or chat line from client p
+*/
+void handleline(struct client *p, char *line) {
+    STAT_ADD(shard->metrics.commands, 1);
+
+    if (!p->name_registered)
+    {
+        //a bot asking for the binary protocol instead of sending its name
+        if (strcmp(line, BINARY_HELLO) == 0) {
+            unsigned char version = BINARY_VERSION;
+            p->binary = 1;
+            queuebinary(p, MSG_HELLO, &version, 1);
+            return;
+        }
+
+        registername(p, line);
+        matchclient(p);
+        return;
+    }
+
+    if (p->watch_prompt) {
+        p->watch_prompt = 0;
+        watchplayer(p, line);
+        return;
+    }
+
+    //speak
+    speak(p, line);
+    
+    //untoggle speech state
+    p->current_match->speech_state = 0;
+}
+
+/*
+Handles a frame from binary client p. frame is the type byte and the payload, followed by a NUL
+*/
+void handleframe(struct client *p, unsigned char *frame, unsigned int len) {
+    char *payload = (char *) frame + 1;
+
+    switch (frame[0]) {
+    case CMD_NAME:
+        if (!p->name_registered) {
+            STAT_ADD(shard->metrics.commands, 1);
+            registername(p, payload);
+            matchclient(p);
+        }
+        break;
+    case CMD_MOVE:
+        //chat has a frame of its own, so 's' is not a move here
+        if (p->name_registered && len == 2 && (payload[0] == 'a' || payload[0] == 'p' || payload[0] == 'r')) {
+            handlecommand(p, payload[0]);
+        }
+        break;
+    case CMD_WATCH:
+        if (!p->name_registered) {
+            break;
+        }
+
+        STAT_ADD(shard->metrics.commands, 1);
+        if (payload[0] == '\0') {
+            if (p->watching) {
+                stopwatching(p);
+                backtolobby(p);
+            }
+        }
+        else {
+            watchplayer(p, payload);
+        }
+        break;
+    case CMD_CHAT:
+        if (!p->name_registered) {
+            break;
+        }
+
+        STAT_ADD(shard->metrics.commands, 1);
+        if (p->in_match && p->current_match->active_player == p) {
+            speak(p, payload);
+        }
+        else {
+            broadcast_to_client(p, "\nWait your turn...\n");
+        }
+        break;
+    }
+}
+
+/*
+Handles a single-byte command from client p
+*/
+void handlecommand(struct client *p, char cmd) {
+    //line endings from line-buffered clients are not commands
+    if (cmd == '\n' || cmd == '\r') {
+        return;
+    }
+
+    STAT_ADD(shard->metrics.commands, 1);
+
+    //game logic
+
+    //shahr start
+    if (p->in_match && p->current_match->active_player == p)
+    {
+        if (cmd == 'a' || cmd == 'p' || cmd == 'r')
+        {
+            if (cmd == 'a') {
+                //regular attack
+                attack(p);
+            }
+            else if (cmd == 'p') {
+                if (p->player_info->powermoves_remaining > 0)
+                {
+                    //powermove
+                    usepowermove(p);
+                }
+                else {
+                    return;
+                }
+            }
+            else if (cmd == 'r') {
+                if (p->player_info->hp_regens_remaining > 0)
+                {
+                    //regenerate hp
+                    usehealthregen(p);
+                    updatedisplay(p->current_match, 1);
+                    spectatestate(p->current_match, 0);
+                }
+
+                return;
+            }
+            
+            if (checkifmatchended(p->current_match) == 1)
+            {
+                //sending winner and loser messages
+                tellresult(p->current_match->winner, RESULT_WIN, "You killed your opponent. You win!\n");
+                tellresult(p->current_match->loser, RESULT_LOSS, "You have died. You lose!\n");
+                
+                tellclient(p->current_match->winner, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+                tellclient(p->current_match->loser, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+
+                if (journal_fd != -1) {
+                    journal_end(p->current_match, JEND_KO);
+                }
+
+                //IMPORTANT: endmatch call must come AFTER broadcast messages to avoid a seg fault
+                endmatch(p->current_match, END_KO);
+                return;
+            }
+            
+            switchturn(p->current_match);
+        
+        }
+        else if (cmd == 's')
+        {
+            p->current_match->speech_state = 1;
+            broadcast_to_client(p, "\nSpeak: ");
+        }
+   
+    //shahr end
+    }
+    else if (!p->in_match && (cmd == 'l' || cmd == 'w' || cmd == 'q')) {
+        lobbycommand(p, cmd);
+    }
+    else {
+        broadcast_to_client(p, "\nWait your turn...\n");
+    }
+}
+
+ /* bind and listen, abort on error
+  * returns FD of listening socket
+  */
+int bindandlisten() {
+    struct sockaddr_in r;
+    int listenfd;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        exit(1);
+    }
+    int yes = 1;
+    if ((setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+    }
+#ifdef SO_REUSEPORT
+    //with several workers, each has its own listening socket on the same port and the kernel spreads connections over them
+    if (worker_count > 1 && (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) == -1) {
+        perror("setsockopt");
+        exit(1);
+    }
+#endif
+    memset(&r, '\0', sizeof(r));
+    r.sin_family = AF_INET;
+    r.sin_addr.s_addr = INADDR_ANY;
+
+    if (listen_port) {
+        //every worker after the first joins the port the first one got
+        r.sin_port = htons(listen_port);
+        if (bind(listenfd, (struct sockaddr *)&r, sizeof r) == -1) {
+            perror("bind");
+            exit(1);
+        }
+    }
+    else {
+        r.sin_port = htons(PORT);
+
+        int i = 0;
+        while (bind(listenfd, (struct sockaddr *)&r, sizeof r) == -1)
+        {
+            printf("Port %d is already in use...trying port %d\n", PORT + i, PORT + i + 1);
+            i++;
+            r.sin_port = htons(PORT + i);
+        }
+
+        listen_port = PORT + i;
+    }
+
+    if (listen(listenfd, listen_backlog)) {
+        perror("listen");
+        exit(1);
+    }
+    return listenfd;
+}
+
+/*
+Accepts the connections waiting on this worker's listening socket, at most ACCEPT_BATCH of them (the rest are reported
+again). Failures that only concern one connection skip it, and running out of descriptors turns connections away,
+so a reconnect storm never takes the server down
+*/
+void acceptclients(int listenfd) {
+    struct sockaddr_in q;
+    socklen_t len;
+    int i;
+
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        len = sizeof(q);
+
+        //client sockets are non-blocking and edge-triggered, so handleclient() must always read until EAGAIN
+#ifdef HAVE_ACCEPT4
+        int clientfd = accept4(listenfd, (struct sockaddr *)&q, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        STAT_ADD(shard->metrics.syscalls, 1);
+#else
+        int clientfd = accept(listenfd, (struct sockaddr *)&q, &len);
+        STAT_ADD(shard->metrics.syscalls, 3); //accept, and setnonblocking's two fcntl calls
+
+        if (clientfd != -1 && setnonblocking(clientfd) == -1) {
+            close(clientfd);
+            continue;
+        }
+#endif
+
+        if (clientfd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return; //drained
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) {
+                continue; //e.g. the client gave up before we got to it
+            }
+
+            if (errno == EMFILE || errno == ENFILE) {
+                //out of descriptors. the listening socket would keep reporting the same connection, so free the
+                //reserved descriptor, take the connection off the queue and turn it away, then reserve one again
+                if (reserve_fd != -1) {
+                    close(reserve_fd);
+                    reserve_fd = -1;
+                }
+
+                int fd = accept(listenfd, NULL, NULL);
+                if (fd != -1) {
+                    rejectclient(fd);
+                }
+
+                reserve_fd = open("/dev/null", O_RDONLY);
+                return;
+            }
+
+            perror("accept"); //e.g. ENOBUFS, which may be gone by the next wakeup
+            return;
+        }
+        STAT_ADD(shard->metrics.accepts, 1);
+
+        //admission control: count the client in first, so workers accepting at the same time can't overshoot together
+        if (max_clients > 0 && __atomic_add_fetch(&server_client_count, 1, __ATOMIC_ACQ_REL) > max_clients) {
+            __atomic_sub_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+            rejectclient(clientfd);
+            continue;
+        }
+
+        if (reactor_add(clientfd, REACTOR_READ | REACTOR_EDGE) == -1) {
+            if (max_clients > 0) {
+                __atomic_sub_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+            }
+            close(clientfd);
+            continue;
+        }
+
+        LOG(LOG_INFO, "Connection from %s", inet_ntoa(q.sin_addr));
+
+        if (max_clients == 0) {
+            __atomic_add_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+        }
+
+        struct client *new_client = addclient(clientfd, q.sin_addr);
+        welcomeclient(new_client);
+    }
+}
+
+/*
+Tells a connection the server can't take that it is full, as far as the socket takes it without blocking, and closes it
+*/
+void rejectclient(int fd) {
+    static const char msg[] = "Sorry, the server is full. Please try again later.\n";
+
+    //best effort: a client that can't take one short line right away isn't worth waiting for
+    ssize_t n = write(fd, msg, sizeof(msg) - 1);
+    (void) n;
+    close(fd);
+    STAT_ADD(shard->metrics.rejected, 1);
+    STAT_ADD(shard->metrics.syscalls, 2);
+}
+
+/*
+Sets up the reactor with the given backend (REACTOR_EPOLL or REACTOR_SELECT)
+returns 0 on success and -1 on error
+*/
+int reactor_init(int backend) {
+    reactor_backend = backend;
+
+#ifdef HAVE_EPOLL
+    if (backend == REACTOR_EPOLL) {
+        if ((epollfd = epoll_create1(0)) == -1) {
+            perror("epoll_create1");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    reactor_backend = REACTOR_SELECT;
+    FD_ZERO(&reactor_rset);
+    FD_ZERO(&reactor_wset);
+    reactor_maxfd = -1;
+    return 0;
+}
+
+#ifdef HAVE_EPOLL
+static unsigned int reactor_epollmask(int events) {
+    unsigned int mask = 0;
+
+    if (events & REACTOR_READ) {
+        mask |= EPOLLIN;
+    }
+    if (events & REACTOR_WRITE) {
+        mask |= EPOLLOUT;
+    }
+    if (events & REACTOR_EDGE) {
+        mask |= EPOLLET;
+    }
+
+    return mask;
+}
+#endif
+
+/*
+Starts watching fd for the given events
+returns 0 on success and -1 on error (e.g. fd does not fit in an fd_set)
+*/
+int reactor_add(int fd, int events) {
+#ifdef HAVE_EPOLL
+    if (reactor_backend == REACTOR_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = reactor_epollmask(events);
+        ev.data.fd = fd;
+
+        STAT_ADD(shard->metrics.syscalls, 1);
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "reactor_add: fd %d is too large for select\n", fd);
+        return -1;
+    }
+
+    return reactor_mod(fd, events);
+}
+
+/*
+Replaces the events fd is watched for
+returns 0 on success and -1 on error
+*/
+int reactor_mod(int fd, int events) {
+#ifdef HAVE_EPOLL
+    if (reactor_backend == REACTOR_EPOLL) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = reactor_epollmask(events);
+        ev.data.fd = fd;
+
+        STAT_ADD(shard->metrics.syscalls, 1);
+        if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (events & REACTOR_READ) {
+        FD_SET(fd, &reactor_rset);
+    }
+    else {
+        FD_CLR(fd, &reactor_rset);
+    }
+
+    if (events & REACTOR_WRITE) {
+        FD_SET(fd, &reactor_wset);
+    }
+    else {
+        FD_CLR(fd, &reactor_wset);
+    }
+
+    if (fd > reactor_maxfd) {
+        reactor_maxfd = fd;
+    }
+    return 0;
+}
+
+/*
+Stops watching fd. Must be called before fd is closed
+*/
+void reactor_del(int fd) {
+#ifdef HAVE_EPOLL
+    if (reactor_backend == REACTOR_EPOLL) {
+        STAT_ADD(shard->metrics.syscalls, 1);
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+#endif
+
+    FD_CLR(fd, &reactor_rset);
+    FD_CLR(fd, &reactor_wset);
+
+    while (reactor_maxfd >= 0 && !FD_ISSET(reactor_maxfd, &reactor_rset) && !FD_ISSET(reactor_maxfd, &reactor_wset)) {
+        reactor_maxfd--;
+    }
+}
+
+/*
+Waits up to timeout_ms milliseconds (-1 for no timeout) for watched fds to become ready
+returns the number of events stored in events, 0 on timeout, and -1 on error
+*/
+int reactor_wait(struct reactor_event *events, int max, int timeout_ms) {
+    int i, n;
+
+#ifdef HAVE_EPOLL
+    if (reactor_backend == REACTOR_EPOLL) {
+        struct epoll_event evs[MAX_EVENTS];
+
+        if (max > MAX_EVENTS) {
+            max = MAX_EVENTS;
+        }
+        
+        STAT_ADD(shard->metrics.syscalls, 1);
+        if ((n = epoll_wait(epollfd, evs, max, timeout_ms)) <= 0) {
+            return n;
+        }
+
+        for (i = 0; i < n; i++) {
+            events[i].fd = evs[i].data.fd;
+            events[i].events = 0;
+
+            //errors and hangups are reported as readable so the next read sees them
+            if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                events[i].events |= REACTOR_READ;
+            }
+            if (evs[i].events & EPOLLOUT) {
+                events[i].events |= REACTOR_WRITE;
+            }
+        }
+        return n;
+    }
+#endif
+
+    fd_set rset = reactor_rset;
+    fd_set wset = reactor_wset;
+    struct timeval tv;
+
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+    }
+
+    STAT_ADD(shard->metrics.syscalls, 1);
+    if ((n = select(reactor_maxfd + 1, &rset, &wset, NULL, timeout_ms >= 0 ? &tv : NULL)) <= 0) {
+        return n;
+    }
+
+    //level-triggered: anything that doesn't fit in events is simply reported again next time
+    n = 0;
+    for (i = 0; i <= reactor_maxfd && n < max; i++) {
+        int ready = 0;
+
+        if (FD_ISSET(i, &rset)) {
+            ready |= REACTOR_READ;
+        }
+        if (FD_ISSET(i, &wset)) {
+            ready |= REACTOR_WRITE;
+        }
+
+        if (ready) {
+            events[n].fd = i;
+            events[n].events = ready;
+            n++;
+        }
+    }
+    return n;
+}
+
+struct client *addclient(int fd, struct in_addr addr) {
+    struct client *p = pool_alloc(&client_pool);
+
+    //grow the session table to fit fd
+    if (fd >= clients_by_fd_len) {
+        int new_len = clients_by_fd_len ? clients_by_fd_len : 64;
+        while (new_len <= fd) {
+            new_len *= 2;
+        }
+
+        struct client **table = realloc(clients_by_fd, new_len * sizeof(struct client *));
+        if (!table) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(table + clients_by_fd_len, 0, (new_len - clients_by_fd_len) * sizeof(struct client *));
+
+        clients_by_fd = table;
+        clients_by_fd_len = new_len;
+    }
+
+    p->fd = fd;
+    p->ipaddr = addr;
+    p->name_registered = 0;
+    p->binary = 0;
+    p->last_input = timer_now;
+    timer_init(&p->deadline, clientdeadline, p);
+    p->name = "";
+    p->in_match = 0;
+    p->client_just_played = NULL;
+    p->waiting = 0;
+    p->wait_next = NULL;
+    p->wait_prev = NULL;
+    p->bucket_next = NULL;
+    p->bucket_prev = NULL;
+    p->rating = RATING_INITIAL;
+    p->rated_matches = 0;
+    p->profile = NULL;
+    p->watching = NULL;
+    p->spec_next = NULL;
+    p->spec_prev = NULL;
+    p->watch_prompt = 0;
+
+    p->player_info = NULL;
+    p->current_match = NULL;
+
+    p->bufferinfo = NULL;
+    p->buffering_input = 1;
+    p->discarding = 0;
+
+    p->outq_head = NULL;
+    p->outq_tail = NULL;
+    p->outq_bytes = 0;
+    p->interest = REACTOR_READ | REACTOR_EDGE;
+    p->want_write = 0;
+    p->throttled = 0;
+    p->closing = 0;
+    p->flush_pending = 0;
+    p->flush_next = NULL;
+    p->close_next = NULL;
+
+    linkclient(p);
+    clients_by_fd[fd] = p;
+    resetdeadline(p);
+
+    (*client_count)++;
+    STAT_SET(shard->metrics.clients, *client_count);
+    return p;
+}
+
+/*
+Returns the client connected on fd, or NULL if there is none
+*/
+struct client *clientbyfd(int fd) {
+    if (fd < 0 || fd >= clients_by_fd_len) {
+        return NULL;
+    }
+    return clients_by_fd[fd];
+}
+
+/*
+Pushes client c onto the top of the client list
+*/
+void linkclient(struct client *c) {
+    c->prev = NULL;
+    c->next = top;
+
+    if (top) {
+        top->prev = c;
+    }
+    top = c;
+}
+
+/*
+Removes client c from the client list (without freeing it)
+*/
+void unlinkclient(struct client *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    }
+    else {
+        top = c->next;
+    }
+
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    c->next = NULL;
+    c->prev = NULL;
+}
+
+void removeclient(struct client *c) {
+    struct client *freed = NULL;
+
+    if (c) {
+        //removing c from the linked list of clients, but not yet deleting it
+        unlinkclient(c);
+        clients_by_fd[c->fd] = NULL;
+        stopwatching(c);
+
+        LOG(LOG_INFO, "Disconnect from %s (%s)", inet_ntoa(c->ipaddr), c->name);
+
+        //only registered names were ever announced (or indexed)
+        if (c->name_registered)
+        {
+            char outbuf[MAX_MSG_LEN];
+            sprintf(outbuf, "**%s leaves**\r\n", c->name);
+            broadcast_arena(c, outbuf);
+        }
+
+        if (c->in_match)
+        {
+            c->current_match->winner = (c->current_match->active_player == c) ? c->current_match->non_active_player : c->current_match->active_player;
+            c->current_match->loser = c;
+
+            //sending winner and loser messages
+            tellresult(c->current_match->winner, RESULT_OPPONENT_DROPPED, "--Opponent dropped. You win!\n");
+            tellclient(c->current_match->winner, MSG_WAITING, NULL, 0, "\nAwaiting next opponent...\n");
+
+            if (journal_fd != -1) {
+                journal_end(c->current_match, JEND_DROPPED);
+            }
+            
+            endmatch(c->current_match, END_DROPPED);
+        }
+
+        //after endmatch, which makes c and its opponent each other's last opponent. that opponent may play whoever
+        //it was kept from now
+        freed = c->client_just_played;
+        forgetlastopponent(c);
+
+        //drop whatever output never made it out
+        clearoutput(c);
+        timer_cancel(&c->deadline);
+
+        if (c->bufferinfo) {
+            pool_free(&bufferinfo_pool, c->bufferinfo);
+        }
+
+        if (c->profile) {
+            profile_seen(c);
+        }
+
+        //c->name is the index's copy, so this comes last
+        if (c->name_registered) {
+            pthread_mutex_lock(&name_index_lock);
+            nameindex_remove(c->name);
+            pthread_mutex_unlock(&name_index_lock);
+        }
+
+        pool_free(&client_pool, c);
+    } else {
+        printf("ERROR\n");
+        exit(1);
+    }
+
+    (*client_count)--;
+    __atomic_sub_fetch(&server_client_count, 1, __ATOMIC_RELEASE);
+    STAT_SET(shard->metrics.clients, *client_count);
+    STAT_ADD(shard->metrics.disconnects, 1);
+
+    matchclient(freed);
+}
+
+void broadcast_all(struct client *sender, char *s, int size) {
+    struct client *p;
+    unsigned long start = nowns();
+
+    //encode once (per protocol, the binary one only if somebody needs it), then every recipient's queue just takes a reference
+    struct msgbuf *m = msg_new(s, size);
+    struct msgbuf *bm = NULL;
+
+    //note: do not broadcast to the sender, and only broadcast to clients who have entered their name
+    for (p = top; p; p = p->next) {
+        if (p != sender && p->name_registered)
+        {
+            if (!p->binary) {
+                queuemsg(p, m);
+                continue;
+            }
+
+            if (!bm) {
+                char frame[FRAME_HEADER_LEN + MAX_MSG_LEN];
+                int len = size < MAX_MSG_LEN ? size : MAX_MSG_LEN;
+
+                frame[0] = (len + 1) >> 8;
+                frame[1] = (len + 1) & 0xff;
+                frame[2] = MSG_TEXT;
+                memcpy(frame + FRAME_HEADER_LEN, s, len);
+                bm = msg_new(frame, FRAME_HEADER_LEN + len);
+            }
+            queuemsg(p, bm);
+        }
+    }
+
+    msg_release(m);
+    if (bm) {
+        msg_release(bm);
+    }
+    recordtime(&shard->metrics.broadcast_all_time, nowns() - start);
+}
+
+void broadcast_to_client(struct client *c, char *s) {
+    if (c->binary) {
+        queuebinary(c, MSG_TEXT, s, strlen(s));
+        return;
+    }
+
+    queueoutput(c, s, strlen(s));
+}
+
+/*
+Queues a frame of the given type and payload for binary client c
+*/
+void queuebinary(struct client *c, int type, const void *payload, size_t len) {
+    unsigned char frame[FRAME_HEADER_LEN + MAX_FRAME_LEN];
+
+    if (len > MAX_FRAME_LEN) {
+        len = MAX_FRAME_LEN;
+    }
+
+    frame[0] = (len + 1) >> 8;
+    frame[1] = (len + 1) & 0xff;
+    frame[2] = type;
+    if (len > 0) {
+        memcpy(frame + FRAME_HEADER_LEN, payload, len);
+    }
+
+    queueoutput(c, (char *) frame, FRAME_HEADER_LEN + len);
+}
+
+/*
+Sends client c a message that binary clients get as a frame of its own: text for text clients, type and payload for binary ones
+*/
+void tellclient(struct client *c, int type, const void *payload, size_t len, char *text) {
+    if (c->binary) {
+        queuebinary(c, type, payload, len);
+    }
+    else {
+        queueoutput(c, text, strlen(text));
+    }
+}
+
+/*
+Tells client c how its match ended (RESULT_*)
+*/
+void tellresult(struct client *c, int result, char *text) {
+    unsigned char r = result;
+    tellclient(c, MSG_MATCH_END, &r, 1, text);
+}
+
+/*
+Tells client c about a move (EVENT_*). Text clients get fmt formatted, binary ones never pay for the formatting
+*/
+void tellevent(struct client *c, int event, int by_opponent, int amount, const char *fmt, ...) {
+    if (c->binary) {
+        unsigned char payload[4] = {event, by_opponent, (amount >> 8) & 0xff, amount & 0xff};
+        queuebinary(c, MSG_EVENT, payload, sizeof(payload));
+        return;
+    }
+
+    char s[MAX_MSG_LEN];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s, sizeof(s), fmt, ap);
+    va_end(ap);
+
+    queueoutput(c, s, strlen(s));
+}
+
+/*
+Sends binary client c a snapshot of its match
+*/
+void sendstate(struct client *c) {
+    //should obv only be called when client c is currently in a match
+    struct match *match = c->current_match;
+    struct client *opp = (c == match->active_player) ? match->non_active_player : match->active_player;
+    unsigned char payload[STATE_PAYLOAD_LEN];
+
+    payload[0] = (c->player_info->hp >> 8) & 0xff;
+    payload[1] = c->player_info->hp & 0xff;
+    payload[2] = c->player_info->powermoves_remaining;
+    payload[3] = c->player_info->hp_regens_remaining;
+    payload[4] = (opp->player_info->hp >> 8) & 0xff;
+    payload[5] = opp->player_info->hp & 0xff;
+    payload[6] = (match->round >> 8) & 0xff;
+    payload[7] = match->round & 0xff;
+    payload[8] = (match->active_player == c);
+
+    queuebinary(c, MSG_STATE, payload, sizeof(payload));
+}
+
+/*
+Appends len bytes of s to client c's output queue. Nothing is written until the flush list is processed
+*/
+void queueoutput(struct client *c, const char *s, size_t len) {
+    if (c->closing || len == 0) {
+        return;
+    }
+
+    //when nobody else shares the message at the back of c's queue, grow it instead, so everything one event
+    //produces for c goes out as one message (one iovec, one segment)
+    struct msgbuf *tail = c->outq_tail ? c->outq_tail->msg : NULL;
+    if (tail && tail->refs == 1 && tail->cap - tail->len >= len) {
+        if (reserveoutput(c, len)) {
+            memcpy(tail->data + tail->len, s, len);
+            tail->len += len;
+        }
+        return;
+    }
+
+    struct msgbuf *m = msg_new(s, len);
+    queuemsg(c, m);
+    msg_release(m);
+}
+
+/*
+Returns a new message holding a copy of s, with one reference owned by the caller
+*/
+struct msgbuf *msg_new(const char *s, size_t len) {
+    struct msgbuf *m;
+
+    if (len <= MSGBUF_SMALL_LEN) {
+        m = pool_alloc(&msgbuf_pool);
+        m->pooled = 1;
+        m->cap = MSGBUF_SMALL_LEN;
+    }
+    else {
+        m = malloc(sizeof(struct msgbuf) + len);
+        if (!m) {
+            perror("malloc");
+            exit(1);
+        }
+        m->pooled = 0;
+        m->cap = len;
+    }
+
+    m->refs = 1;
+    m->len = len;
+    memcpy(m->data, s, len);
+    return m;
+}
+
+/*
+Drops a reference to m, freeing it once nobody refers to it anymore
+*/
+void msg_release(struct msgbuf *m) {
+    if (--m->refs > 0) {
+        return;
+    }
+
+    if (m->pooled) {
+        pool_free(&msgbuf_pool, m);
+    }
+    else {
+        free(m);
+    }
+}
+
+/*
+Appends a reference to message m to client c's output queue, without copying it
+*/
+void queuemsg(struct client *c, struct msgbuf *m) {
+    if (c->closing || m->len == 0 || !reserveoutput(c, m->len)) {
+        return;
+    }
+
+    struct outchunk *chunk = pool_alloc(&outchunk_pool);
+    chunk->next = NULL;
+    chunk->msg = m;
+    chunk->off = 0;
+    m->refs++;
+
+    if (c->outq_tail) {
+        c->outq_tail->next = chunk;
+    }
+    else {
+        c->outq_head = chunk;
+    }
+    c->outq_tail = chunk;
+}
+
+/*
+Accounts for len more bytes on client c's output queue, and puts c on the flush list.
+returns 1 if the bytes may be queued, and 0 if c went over the hard limit and was marked for removal
+*/
+int reserveoutput(struct client *c, size_t len) {
+    if (c->outq_bytes + len > outq_hard_limit) {
+        //slow consumer: drop it rather than let its queue grow without bound
+        LOG(LOG_WARN, "Output queue of %s is over %lu bytes, disconnecting", c->name, (unsigned long) outq_hard_limit);
+        markclosing(c);
         return 0;
     }
 
-    //check if username already exists, and if so, alert the client:
-    struct client *p;
-    for (p = top; p; p = p->next) {
-        if (p != c && strcmp(p->name, c->name) == 0)
-        {
-            //username taken!
-            memset(c->name, 0, MAX_NAME_LEN);
+    c->outq_bytes += len;
+
+    if (c->outq_bytes > outq_soft_limit && !c->throttled) {
+        //stop reading input from c until it catches up
+        c->throttled = 1;
+        updateinterest(c);
+    }
+
+    if (!c->flush_pending) {
+        c->flush_pending = 1;
+        c->flush_next = flush_list;
+        flush_list = c;
+    }
+    return 1;
+}
+
+/*
+Drops everything in client c's output queue
+*/
+void clearoutput(struct client *c) {
+    struct outchunk *chunk = c->outq_head;
+
+    while (chunk) {
+        struct outchunk *next = chunk->next;
+        msg_release(chunk->msg);
+        pool_free(&outchunk_pool, chunk);
+        chunk = next;
+    }
+
+    c->outq_head = NULL;
+    c->outq_tail = NULL;
+    c->outq_bytes = 0;
+}
+
+/*
+Writes as much of client c's output queue as the socket accepts, using writev to coalesce queued chunks
+returns 0 if the queue was emptied, 1 if the socket is full, and -1 if c was marked for removal
+*/
+int flushclient(struct client *c) {
+    struct iovec iov[MAX_IOV];
+
+    while (c->outq_head) {
+        struct outchunk *chunk;
+        int iovcnt = 0;
+
+        for (chunk = c->outq_head; chunk && iovcnt < MAX_IOV; chunk = chunk->next) {
+            iov[iovcnt].iov_base = chunk->msg->data + chunk->off;
+            iov[iovcnt].iov_len = chunk->msg->len - chunk->off;
+            iovcnt++;
+        }
+
+        ssize_t written = writev(c->fd, iov, iovcnt);
+        STAT_ADD(shard->metrics.syscalls, 1);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                //wait for the socket to become writable
+                if (!c->want_write) {
+                    c->want_write = 1;
+                    updateinterest(c);
+                }
+                return 1;
+            }
+
+            markclosing(c);
+            return -1;
+        }
 
-            printf("Received %d bytes. Desired name of client %s is: %s, but name is already taken\n", (int) strlen(s), inet_ntoa(c->ipaddr), c->name);
+        //free whatever was written completely
+        STAT_ADD(shard->metrics.bytes_out, written);
+        c->outq_bytes -= written;
+        while (written > 0) {
+            chunk = c->outq_head;
+            size_t left = chunk->msg->len - chunk->off;
 
-            char *s = "Sorry, that name is already taken. Please type another name:\n";
-            broadcast_to_client(c, s); //alert the client
-            return 0;
+            if ((size_t) written < left) {
+                chunk->off += written;
+                break;
+            }
+
+            written -= left;
+            c->outq_head = chunk->next;
+            msg_release(chunk->msg);
+            pool_free(&outchunk_pool, chunk);
+        }
+
+        if (!c->outq_head) {
+            c->outq_tail = NULL;
+        }
+    }
+
+    //queue is empty: stop waiting for writability, and start reading again if c was throttled
+    if (c->want_write || c->throttled) {
+        c->want_write = 0;
+        c->throttled = 0;
+        updateinterest(c);
+    }
+    return 0;
+}
+
+/*
+Flushes every client that had output queued since the last call
+*/
+void flushpending() {
+    while (flush_list) {
+        struct client *c = flush_list;
+        flush_list = c->flush_next;
+
+        c->flush_pending = 0;
+        c->flush_next = NULL;
+
+        if (!c->closing && !c->want_write) {
+            flushclient(c);
         }
-    }    
+    }
+}
+
+/*
+Registers the reactor events client c currently needs: input unless throttled, writability while output is stuck
+*/
+void updateinterest(struct client *c) {
+    int events = REACTOR_EDGE;
+
+    if (!c->throttled) {
+        events |= REACTOR_READ;
+    }
+    if (c->want_write) {
+        events |= REACTOR_WRITE;
+    }
+
+    //re-enabling input also re-reports anything that arrived while c was throttled
+    if (events != c->interest && reactor_mod(c->fd, events) == 0) {
+        c->interest = events;
+    }
+}
+
+/*
+Marks client c for removal. The client is removed by reapclients() once the current event has been handled,
+so that code which is still using c (or iterating over clients) never sees it freed
+*/
+void markclosing(struct client *c) {
+    if (c->closing) {
+        return;
+    }
+
+    c->closing = 1;
+    c->close_next = close_list;
+    close_list = c;
 
-    printf("Received %d bytes. Name of client %s is: %s\n", (int) strlen(s), inet_ntoa(c->ipaddr), c->name);
+    //never match a client that is on its way out
+    dequeuewaiting(c);
+}
+
+/*
+Removes and closes every client marked for removal
+*/
+void reapclients() {
+    struct client *list = close_list;
+    close_list = NULL;
+
+    while (list) {
+        struct client *c = list;
+        list = c->close_next;
+
+        int fd = c->fd;
+        removeclient(c);
+
+        reactor_del(fd);
+        close(fd);
+        STAT_ADD(shard->metrics.syscalls, 1);
+    }
+}
+
+/*
+Puts fd in non-blocking mode
+returns 0 on success and -1 on error
+*/
+int setnonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+Register name of client c
+returns -1 if there was an error reading, 0 if username is already taken, and 1 if successful
+*/
+int registername(struct client *c, char *s) {
+    unsigned char reason;
+
+    if (strlen(s) >= MAX_NAME_LEN)
+    {
+        char *s = "Sorry, that name is too long. Please type a shorter name:\n";
+        reason = NAME_TOO_LONG;
+        tellclient(c, MSG_NAME_REJECTED, &reason, 1, s); //alert the client
+        return 0;
+    }
+
+    if (strlen(s) == 0)
+    {
+        char *s = "Sorry, you cannot type an empty name. Please try again:\n";
+        reason = NAME_EMPTY;
+        tellclient(c, MSG_NAME_REJECTED, &reason, 1, s); //alert the client
+        return 0;
+    }
+
+    //check if username already exists (on any worker), and if not, claim it:
+    pthread_mutex_lock(&name_index_lock);
+    int taken = nameindex_find(s);
+    if (!taken) {
+        c->name = nameindex_insert(s); //the index's copy is the only one
+    }
+    pthread_mutex_unlock(&name_index_lock);
+
+    if (taken)
+    {
+        //username taken!
+        LOG(LOG_INFO, "Received %d bytes. Desired name of client %s is: %s, but name is already taken", (int) strlen(s), inet_ntoa(c->ipaddr), s);
+
+        char *s = "Sorry, that name is already taken. Please type another name:\n";
+        reason = NAME_TAKEN;
+        tellclient(c, MSG_NAME_REJECTED, &reason, 1, s); //alert the client
+        return 0;
+    }
+
+    LOG(LOG_INFO, "Received %d bytes. Name of client %s is: %s", (int) strlen(s), inet_ntoa(c->ipaddr), c->name);
     
     c->name_registered = 1;
+    resetdeadline(c);
+
+    //a returning player picks up where they left off (before enqueuewaiting, which indexes c by rating)
+    if (profile_fd != -1) {
+        profile_load(c);
+    }
+    enqueuewaiting(c);
 
-    char *s1 = "\nAwaiting opponent...\n";
-    broadcast_to_client(c, s1);
+    char *s1 = "\nAwaiting opponent...\n(l)ist live matches, or (w)atch one\n";
+    tellclient(c, MSG_WAITING, NULL, 0, s1);
     
     //alert entire arena of new player
     char s2[MAX_MSG_LEN];
     sprintf(s2, "\n**%s enters the arena**\n", c->name);
-    broadcast_all(c, s2, strlen(s2));
+    broadcast_arena(c, s2);
     
     return 1;
 }
 
+/*
+FNV-1a hash of a name
+*/
+unsigned int hashname(const char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+Returns 1 if name is registered, 0 if it is free. Callers hold name_index_lock
+*/
+int nameindex_find(const char *name) {
+    if (name_index_count == 0) {
+        return 0;
+    }
+
+    unsigned int mask = name_index_slots - 1;
+    unsigned int h = hashname(name);
+    unsigned int i;
+
+    for (i = h & mask; name_index[i].name; i = (i + 1) & mask) {
+        if (name_index[i].hash == h && strcmp(name_index[i].name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Doubles the name index (or creates it), rehashing every registered name
+*/
+static void nameindex_grow() {
+    unsigned int old_slots = name_index_slots;
+    struct name_slot *old = name_index;
+
+    name_index_slots = old_slots ? old_slots * 2 : NAME_INDEX_MIN_SLOTS;
+    name_index = calloc(name_index_slots, sizeof(struct name_slot));
+    if (!name_index) {
+        perror("calloc");
+        exit(1);
+    }
+
+    unsigned int mask = name_index_slots - 1;
+    unsigned int i, j;
+
+    for (i = 0; i < old_slots; i++) {
+        if (old[i].name) {
+            for (j = old[i].hash & mask; name_index[j].name; j = (j + 1) & mask);
+            name_index[j] = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/*
+Adds name to the name index. The name must not already be in it. Callers hold name_index_lock
+*/
+const char *nameindex_insert(const char *name) {
+    //keep the load factor at or below 1/2 so probe sequences stay short
+    if ((name_index_count + 1) * 2 > name_index_slots) {
+        nameindex_grow();
+    }
+
+    unsigned int mask = name_index_slots - 1;
+    unsigned int h = hashname(name);
+    unsigned int i;
+
+    for (i = h & mask; name_index[i].name; i = (i + 1) & mask);
+
+    name_index[i].hash = h;
+    name_index[i].name = strdup(name);
+    if (!name_index[i].name) {
+        perror("strdup");
+        exit(1);
+    }
+    name_index_count++;
+
+    return name_index[i].name;
+}
+
+/*
+Removes name from the name index, if it is there. Callers hold name_index_lock
+*/
+void nameindex_remove(const char *name) {
+    if (name_index_count == 0) {
+        return;
+    }
+
+    unsigned int mask = name_index_slots - 1;
+    unsigned int h = hashname(name);
+    unsigned int i, j;
+
+    for (i = h & mask; ; i = (i + 1) & mask) {
+        if (!name_index[i].name) {
+            return;
+        }
+        if (name_index[i].hash == h && strcmp(name_index[i].name, name) == 0) {
+            break;
+        }
+    }
+
+    free(name_index[i].name);
+
+    //backward-shift deletion: pull later entries of the probe run into the hole, so no tombstones are needed
+    for (j = (i + 1) & mask; name_index[j].name; j = (j + 1) & mask) {
+        unsigned int home = name_index[j].hash & mask;
+
+        //move entry j into hole i unless its home slot lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            name_index[i] = name_index[j];
+            i = j;
+        }
+    }
+
+    name_index[i].name = NULL;
+    name_index_count--;
+}
+
 void welcomeclient(struct client *c) {
     char *s = "Welcome to the Battle Server! Please enter your name to begin:\n";
     broadcast_to_client(c, s);
@@ -536,41 +4893,263 @@ void welcomeclient(struct client *c) {
 
 
 /*
-Returns NULL if no available opponent found
+Returns the rating bucket for rating
+*/
+static int ratingbucket(int rating) {
+    int b = rating / RATING_BUCKET_WIDTH;
+    return b < 0 ? 0 : (b >= RATING_BUCKETS ? RATING_BUCKETS - 1 : b);
+}
+
+/*
+Returns the first non-empty rating bucket at or above b, or -1 if there is none
+*/
+static int nextbucket(int b) {
+    if (b >= RATING_BUCKETS) {
+        return -1;
+    }
+
+    int w = b / 64;
+    uint64_t bits = bucket_used[w] & (~0ULL << (b % 64));
+    while (!bits) {
+        if (++w == RATING_BUCKETS / 64) {
+            return -1;
+        }
+        bits = bucket_used[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+/*
+Returns the last non-empty rating bucket at or below b, or -1 if there is none
+*/
+static int prevbucket(int b) {
+    if (b < 0) {
+        return -1;
+    }
+
+    int w = b / 64;
+    uint64_t bits = bucket_used[w] & (~0ULL >> (63 - b % 64));
+    while (!bits) {
+        if (--w < 0) {
+            return -1;
+        }
+        bits = bucket_used[w];
+    }
+    return w * 64 + 63 - __builtin_clzll(bits);
+}
+
+/*
+Returns the waiting client closest in rating that c may play, or NULL if there is none within c's window.
+The window starts at RATING_WINDOW and grows by RATING_WINDOW_GROWTH for every second c has waited.
+Buckets are searched nearest first, and within a bucket whoever has waited longest comes first.
+Since client_just_played is mutual, at most two clients (c and its last opponent) are ever skipped
 */
 struct client* findopponent(struct client *c) {
-    for (struct client *p = top; p; p = p->next)
+    unsigned long waited = (nowns() - c->wait_since) / 1000000000UL;
+    unsigned long window = RATING_WINDOW + RATING_WINDOW_GROWTH * waited;
+    int home = ratingbucket(c->rating);
+    int up = nextbucket(home);
+    int down = prevbucket(home - 1);
+
+    //walk outwards from c's own bucket, always taking the nearer side next
+    while (up != -1 || down != -1) {
+        int b;
+        if (down == -1 || (up != -1 && up - home <= home - down)) {
+            b = up;
+            up = nextbucket(up + 1);
+        }
+        else {
+            b = down;
+            down = prevbucket(down - 1);
+        }
+
+        //the nearest rating a bucket d buckets away can hold is (d - 1) * RATING_BUCKET_WIDTH + 1 from c's
+        int d = abs(b - home);
+        if (d > 0 && (unsigned long) (d - 1) * RATING_BUCKET_WIDTH >= window) {
+            break; //the other side is at least as far
+        }
+
+        for (struct client *p = bucket_head[b]; p; p = p->bucket_next)
+        {
+            //p is not c, p has not just played against c in his previous match (or vice versa), and p is really
+            //within the window, not just in a bucket that overlaps it
+            if (p != c && p->client_just_played != c && c->client_just_played != p &&
+                (unsigned long) abs(p->rating - c->rating) <= window)
+            {
+                return p;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Pairs up waiting clients, longest-waiting first (so the widest windows get the first pick), until nobody in the queue
+has an available opponent. Whoever is left gets another look after MATCHMAKING_RETRY_MS, when their windows are wider
+*/
+void matchloneclients() {
+    struct client *p = wait_head;
+    unsigned long start = nowns();
+
+    while (p && wait_count >= 2)
     {
-        //p is not NULL, p has registered his name, p is not in a match, and p has not just played against c in his previous match
-        if (p != c && p->name_registered && !p->in_match && p->client_just_played != c)
+        //find an opponent to match him up with (if available)
+        struct client *opp = findopponent(p);
+        struct client *next = p->wait_next;
+
+        if (opp != NULL)
         {
-            return p;
-        }        
+            //create match (which takes both clients out of the queue). anyone skipped so far still has nobody,
+            //so carry on from here rather than from the front
+            if (next == opp) {
+                next = opp->wait_next;
+            }
+            creatematch(p, opp);
+        }
+        p = next;
+    }
+
+    if (wait_count >= 2) {
+        timer_arm(&matchmaking_timer, MATCHMAKING_RETRY_MS);
+    }
+    else {
+        timer_cancel(&matchmaking_timer);
+    }
+
+    recordtime(&shard->metrics.matchloneclients_time, nowns() - start);
+}
+
+void matchmakingretry(void *owner) {
+    matchloneclients();
+}
+
+/*
+Gives client c, who just joined the matchmaking queue (or may now play someone it couldn't before), one look for an
+opponent. Nobody else's prospects changed, so this is all an event costs however many are queued: rescanning the queue
+as windows widen is left to the matchmaking timer, which this arms while anybody is left waiting. c may be NULL, to
+just do the latter (e.g. after somebody left the queue)
+*/
+void matchclient(struct client *c) {
+    unsigned long start = nowns();
+
+    if (c && c->waiting && !c->closing) {
+        struct client *opp = findopponent(c);
+        if (opp) {
+            creatematch(c, opp);
+        }
+    }
+
+    //don't push back a retry that is already due
+    if (wait_count >= 2) {
+        if (!timer_left_ms(&matchmaking_timer)) {
+            timer_arm(&matchmaking_timer, MATCHMAKING_RETRY_MS);
+        }
+    }
+    else {
+        timer_cancel(&matchmaking_timer);
+    }
+
+    recordtime(&shard->metrics.matchloneclients_time, nowns() - start);
+}
+
+/*
+Clears client c's last-opponent link in both directions
+*/
+void forgetlastopponent(struct client *c) {
+    if (c->client_just_played)
+    {
+        c->client_just_played->client_just_played = NULL;
+        c->client_just_played = NULL;
+    }
+}
+
+/*
+Appends client c to the back of the matchmaking queue
+*/
+void enqueuewaiting(struct client *c) {
+    if (c->waiting || c->closing) {
+        return;
+    }
+
+    c->waiting = 1;
+    c->wait_since = nowns();
+    c->wait_next = NULL;
+    c->wait_prev = wait_tail;
+
+    if (wait_tail) {
+        wait_tail->wait_next = c;
+    }
+    else {
+        wait_head = c;
+    }
+    wait_tail = c;
+
+    int b = ratingbucket(c->rating);
+    c->bucket_next = NULL;
+    c->bucket_prev = bucket_tail[b];
+    if (bucket_tail[b]) {
+        bucket_tail[b]->bucket_next = c;
+    }
+    else {
+        bucket_head[b] = c;
+        bucket_used[b / 64] |= 1ULL << (b % 64);
+    }
+    bucket_tail[b] = c;
+
+    wait_count++;
+    STAT_SET(shard->metrics.lobby, wait_count);
+}
+
+/*
+Takes client c out of the matchmaking queue, if it is in it
+*/
+void dequeuewaiting(struct client *c) {
+    if (!c->waiting) {
+        return;
+    }
+
+    if (c->wait_prev) {
+        c->wait_prev->wait_next = c->wait_next;
+    }
+    else {
+        wait_head = c->wait_next;
     }
 
-    return NULL;    
-}
+    if (c->wait_next) {
+        c->wait_next->wait_prev = c->wait_prev;
+    }
+    else {
+        wait_tail = c->wait_prev;
+    }
 
-/*
+    //c's rating hasn't changed since it was queued, so this is the bucket it went in
+    int b = ratingbucket(c->rating);
+    if (c->bucket_prev) {
+        c->bucket_prev->bucket_next = c->bucket_next;
+    }
+    else {
+        bucket_head[b] = c->bucket_next;
+    }
 
-*/
-void matchloneclients() {
-    for (struct client *p = top; p; p = p->next) 
-    {
-        if (p->name_registered && !p->in_match)
-        {
-            //if client not in a match, find an opponent to match him up with (if available)
-            struct client *opp = findopponent(p);
+    if (c->bucket_next) {
+        c->bucket_next->bucket_prev = c->bucket_prev;
+    }
+    else {
+        bucket_tail[b] = c->bucket_prev;
+    }
 
-            if (opp != NULL)
-            {
-                //create match
-                creatematch(p, opp);
-            }
-        }
-        
+    if (!bucket_head[b]) {
+        bucket_used[b / 64] &= ~(1ULL << (b % 64));
     }
-    
+
+    c->waiting = 0;
+    c->wait_next = NULL;
+    c->wait_prev = NULL;
+    c->bucket_next = NULL;
+    c->bucket_prev = NULL;
+    wait_count--;
+    STAT_SET(shard->metrics.lobby, wait_count);
 }
 
 
@@ -578,26 +5157,69 @@ void matchloneclients() {
 Returns the newly created match
 */
 struct match* creatematch(struct client *c1, struct client *c2) {
+    unsigned long now = nowns();
+    recordtime(&shard->metrics.matchmaking, now - c1->wait_since);
+    recordtime(&shard->metrics.matchmaking, now - c2->wait_since);
+    STAT_ADD(shard->metrics.matches_started, 1);
+
+    dequeuewaiting(c1);
+    dequeuewaiting(c2);
+
+    //a new match replaces the last one, so release the previous opponents' rematch restriction too.
+    //this keeps client_just_played mutual, which removeclient relies on to never leave it dangling
+    forgetlastopponent(c1);
+    forgetlastopponent(c2);
+
     c1->in_match = 1;
     c2->in_match = 1;
 
-    //mallocing the match
-    struct match *match = malloc(sizeof(struct match));
+    //a player who was typing whose match to watch isn't anymore: the next line is a move (or chat), not a name.
+    //a name typed halfway is skipped up to its end
+    struct client *players[2] = {c1, c2};
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (players[i]->watch_prompt) {
+            players[i]->watch_prompt = 0;
+            if (players[i]->bufferinfo && !players[i]->binary) {
+                players[i]->discarding = 1;
+            }
+        }
+        players[i]->buffering_input = 0;
+    }
+
+    //allocating the match
+    struct match *match = pool_alloc(&match_pool);
+    timer_init(&match->turn_timer, turntimeout, match);
+    linkmatch(match);
+
+    match->seed = splitmix64(&seed_source);
+    rng_seed(&match->rng, match->seed);
+    LOG(LOG_INFO, "%s engages %s, match seed %llu", c1->name, c2->name, (unsigned long long) match->seed);
 
     //assigning the players to the match
     match->players[0] = c1;
     match->players[1] = c2;
 
-    //randomly assigning the starting player
-    match->starting_player = match->players[rand() % 2];
+    //the engine rolls the starting player, resources and hp
+    struct engine_setup setup;
+    engine_start(&rules, &match->rng, &setup);
+
+    match->starting_player = match->players[setup.starting_player];
     match->active_player = match->starting_player;
     match->non_active_player = match->starting_player == c1 ? c2 : c1;
 
     //match info
     match->round = 0;
     match->speech_state = 0; //to indicate that no player is speaking rn
-    match->powermove_count = POWERMOVE_COUNT_MIN + (rand() % (POWERMOVE_COUNT_MAX - POWERMOVE_COUNT_MIN + 1)); //random number of powermoves
-    match->hp_regen_count = HP_REGEN_COUNT_MIN + (rand() % (HP_REGEN_COUNT_MAX - HP_REGEN_COUNT_MIN + 1)); //random number of hp regens
+    match->spectators = NULL;
+    match->text_spectators = 0;
+    match->binary_spectators = 0;
+    match->stream_text = NULL;
+    match->stream_binary = NULL;
+    match->stream_next = NULL;
+    match->stream_prev = NULL;
+    match->powermove_count = setup.powermoves;
+    match->hp_regen_count = setup.regens;
 
     //setting current match
     c1->current_match = match;
@@ -605,27 +5227,30 @@ struct match* creatematch(struct client *c1, struct client *c2) {
 
 
     //setting the players' powermoves (equal for both players)
-    c1->player_info = malloc(sizeof(struct player_info));
+    c1->player_info = pool_alloc(&player_info_pool);
     c1->player_info->powermoves_remaining = match->powermove_count;
     c1->player_info->hp_regens_remaining = match->hp_regen_count;
     
-    c2->player_info = malloc(sizeof(struct player_info));
+    c2->player_info = pool_alloc(&player_info_pool);
     c2->player_info->powermoves_remaining = match->powermove_count;
     c2->player_info->hp_regens_remaining = match->hp_regen_count;
     
-    //setting the health points randomly (not necessarily equal for both players)
-    c1->player_info->hp = HP_MIN + (rand() % (HP_MAX - HP_MIN + 1));
-    c2->player_info->hp = HP_MIN + (rand() % (HP_MAX - HP_MIN + 1));
+    c1->player_info->hp = setup.hp[0];
+    c2->player_info->hp = setup.hp[1];
+
+    if (journal_fd != -1) {
+        journal_start(match);
+    }
 
 
     //alert clients that they have engaged each other
     char s1[MAX_MSG_LEN];
     sprintf(s1, "You engage %s!\n", c2->name);
-    broadcast_to_client(c1, s1);
+    tellclient(c1, MSG_MATCH_START, c2->name, strlen(c2->name), s1);
     
     char s2[MAX_MSG_LEN];
     sprintf(s2, "You engage %s!\n", c1->name);
-    broadcast_to_client(c2, s2);
+    tellclient(c2, MSG_MATCH_START, c1->name, strlen(c1->name), s2);
     
     //switchturn to initiate game properly
     switchturn(match);
@@ -634,44 +5259,126 @@ struct match* creatematch(struct client *c1, struct client *c2) {
 }
 
 /*
-Returns the new head of the client list (may be unchanged)
+Ends match the way reason (END_*) says, returning it and both players' per-match state to their pools, and requeues the players
 */
-void endmatch(struct match *match) {
+void endmatch(struct match *match, int reason) {
+    timer_cancel(&match->turn_timer);
+    spectateend(match, reason);
+    updateratings(match);
+
     match->players[0]->in_match = 0;
     match->players[0]->current_match = NULL;
     match->players[0]->client_just_played = match->players[1];
+    pool_free(&player_info_pool, match->players[0]->player_info);
+    match->players[0]->player_info = NULL;
 
     match->players[1]->in_match = 0;
     match->players[1]->current_match = NULL;
     match->players[1]->client_just_played = match->players[0];
+    pool_free(&player_info_pool, match->players[1]->player_info);
+    match->players[1]->player_info = NULL;
 
-    //send clients to end of list (first come, first serve). which client gets moved first will be random
-    int first = rand() % 2; //0 or 1
+    //send clients to end of the matchmaking queue (first come, first serve). which client gets moved first will be random
+    int first = rng_below(&match->rng, 2); //0 or 1
     int second = (first == 0) ? 1 : 0;
 
-    moveclienttoendoflist(match->players[first]);
-    moveclienttoendoflist(match->players[second]);
+    struct client *c1 = match->players[first];
+    struct client *c2 = match->players[second];
+    moveclienttoendoflist(c1);
+    moveclienttoendoflist(c2);
 
-    // top = match->players[second];
+    unlinkmatch(match);
+    pool_free(&match_pool, match);
+    STAT_ADD(shard->metrics.matches_ended, 1);
 
-    free(match);
+    matchclient(c1);
+    matchclient(c2);
+}
 
-    matchloneclients();
+/*
+Adds match to the worker's list of live matches
+*/
+void linkmatch(struct match *match) {
+    match->prev = NULL;
+    match->next = live_matches;
+
+    if (live_matches) {
+        live_matches->prev = match;
+    }
+    live_matches = match;
+    live_match_count++;
+}
+
+/*
+Takes match off the worker's list of live matches
+*/
+void unlinkmatch(struct match *match) {
+    if (match->prev) {
+        match->prev->next = match->next;
+    }
+    else {
+        live_matches = match->next;
+    }
+
+    if (match->next) {
+        match->next->prev = match->prev;
+    }
+
+    match->next = NULL;
+    match->prev = NULL;
+    live_match_count--;
 }
 
+/*
+Moves the ratings of match's winner and loser by how unexpected the result was (Elo), and tells them
+*/
+void updateratings(struct match *match) {
+    struct client *w = match->winner;
+    struct client *l = match->loser;
+    int k[2], delta[2], i;
+
+    //the winner's expected score, from 0 (a sure loss) to 1 (a sure win)
+    double expected = 1.0 / (1.0 + pow(10.0, (l->rating - w->rating) / 400.0));
+
+    k[0] = w->rated_matches < RATING_PROVISIONAL_MATCHES ? RATING_K_PROVISIONAL : RATING_K;
+    k[1] = l->rated_matches < RATING_PROVISIONAL_MATCHES ? RATING_K_PROVISIONAL : RATING_K;
+    delta[0] = (int) lround(k[0] * (1.0 - expected));
+    delta[1] = -(int) lround(k[1] * (1.0 - expected));
+
+    LOG(LOG_INFO, "%s (%d%+d) beats %s (%d%+d)", w->name, w->rating, delta[0], l->name, l->rating, delta[1]);
+
+    struct client *players[2] = {w, l};
+    for (i = 0; i < 2; i++) {
+        struct client *c = players[i];
+        c->rating += delta[i];
+        c->rated_matches++;
+
+        if (profile_fd != -1) {
+            profile_save(c, i == 0);
+        }
+
+        if (!c->closing) {
+            char s[MAX_MSG_LEN];
+            sprintf(s, "Your rating: %d (%+d)\n", c->rating, delta[i]);
+            tellclient(c, MSG_TEXT, s, strlen(s), s);
+        }
+    }
+}
 
 void attack(struct client *c) {
     //should obv only be called when client c is currently in a match
-    int dmg = REGULAR_DMG_MIN + (rand() % (REGULAR_DMG_MAX - REGULAR_DMG_MIN + 1));
-    c->current_match->non_active_player->player_info->hp -= dmg;
+    struct client *opp = c->current_match->non_active_player;
+    int dmg = engine_play(&rules, &c->current_match->rng, MOVE_ATTACK, c->player_info, opp->player_info);
 
-    char s1[MAX_MSG_LEN];
-    sprintf(s1, "\nYou hit %s for %d damage!\n", c->current_match->non_active_player->name, dmg);
-    broadcast_to_client(c, s1);
+    if (journal_fd != -1) {
+        journal_move(c, JMOVE_ATTACK, dmg);
+    }
 
-    char s2[MAX_MSG_LEN];
-    sprintf(s2, "\n%s hits you for %d damage!\n", c->name, dmg);
-    broadcast_to_client(c->current_match->non_active_player, s2);
+    tellevent(c, EVENT_HIT, 0, dmg, "\nYou hit %s for %d damage!\n", opp->name, dmg);
+    tellevent(opp, EVENT_HIT, 1, dmg, "\n%s hits you for %d damage!\n", c->name, dmg);
+
+    unsigned char payload[4] = {EVENT_HIT, c == c->current_match->players[1], (dmg >> 8) & 0xff, dmg & 0xff};
+    spectate(c->current_match, MSG_WATCH_EVENT, payload, sizeof(payload), "\n%s hits %s for %d damage!\n", c->name, opp->name, dmg);
 }
 
 int usepowermove(struct client *c) {
@@ -683,29 +5390,33 @@ int usepowermove(struct client *c) {
         exit(1);
     }
     
-    int hit = (rand() % POWERMOVE_CHANCE == 0) ? 1 : 0;
-    
-    char s1[MAX_MSG_LEN];
-    char s2[MAX_MSG_LEN];
+    struct client *opp = c->current_match->non_active_player;
+    int dmg = engine_play(&rules, &c->current_match->rng, MOVE_POWERMOVE, c->player_info, opp->player_info);
+    int hit = dmg != ENGINE_MISSED;
 
     if (hit)
     {
-        int dmg = (REGULAR_DMG_MIN + (rand() % (REGULAR_DMG_MAX - REGULAR_DMG_MIN + 1))) * POWERMOVE_DMG_MULTIPLIER;
-        c->current_match->non_active_player->player_info->hp -= dmg;
+        if (journal_fd != -1) {
+            journal_move(c, JMOVE_POWERMOVE, dmg);
+        }
 
-        sprintf(s1, "\nYou powermove %s for %d damage!\n", c->current_match->non_active_player->name, dmg);
-        sprintf(s2, "\n%s powermoves you for %d damage!\n", c->name, dmg);
+        tellevent(c, EVENT_POWERMOVE, 0, dmg, "\nYou powermove %s for %d damage!\n", opp->name, dmg);
+        tellevent(opp, EVENT_POWERMOVE, 1, dmg, "\n%s powermoves you for %d damage!\n", c->name, dmg);
+
+        unsigned char payload[4] = {EVENT_POWERMOVE, c == c->current_match->players[1], (dmg >> 8) & 0xff, dmg & 0xff};
+        spectate(c->current_match, MSG_WATCH_EVENT, payload, sizeof(payload), "\n%s powermoves %s for %d damage!\n", c->name, opp->name, dmg);
     }
     else {
-        sprintf(s1, "\nYou missed your powermove!\n");
-        sprintf(s2, "\n%s missed his powermove against you!\n", c->name);
-    }
+        if (journal_fd != -1) {
+            journal_move(c, JMOVE_POWERMOVE_MISSED, 0);
+        }
 
-    broadcast_to_client(c, s1);
-    broadcast_to_client(c->current_match->non_active_player, s2);
+        tellevent(c, EVENT_POWERMOVE_MISSED, 0, 0, "\nYou missed your powermove!\n");
+        tellevent(opp, EVENT_POWERMOVE_MISSED, 1, 0, "\n%s missed his powermove against you!\n", c->name);
 
-    
-    c->player_info->powermoves_remaining--;
+        unsigned char payload[4] = {EVENT_POWERMOVE_MISSED, c == c->current_match->players[1], 0, 0};
+        spectate(c->current_match, MSG_WATCH_EVENT, payload, sizeof(payload), "\n%s misses a powermove against %s!\n", c->name, opp->name);
+    }
     
     return hit; //1 if hit, 0 if missed
 }
@@ -719,101 +5430,448 @@ void usehealthregen(struct client *c) {
         exit(1);
     }
     
-    int regen_amt = HP_REGEN_MIN + (rand() % (HP_REGEN_MAX - HP_REGEN_MIN + 1));
-    c->player_info->hp += regen_amt;
-
-    char s1[MAX_MSG_LEN];
-    char s2[MAX_MSG_LEN];
+    int regen_amt = engine_play(&rules, &c->current_match->rng, MOVE_REGEN, c->player_info, c->current_match->non_active_player->player_info);
 
-    sprintf(s1, "\nYou regenerated %d HP!", regen_amt);
-    sprintf(s2, "\n%s regenerated %d HP!", c->name, regen_amt);
+    if (journal_fd != -1) {
+        journal_move(c, JMOVE_REGEN, regen_amt);
+    }
 
-    broadcast_to_client(c, s1);
-    broadcast_to_client(c->current_match->non_active_player, s2);
+    tellevent(c, EVENT_REGEN, 0, regen_amt, "\nYou regenerated %d HP!", regen_amt);
+    tellevent(c->current_match->non_active_player, EVENT_REGEN, 1, regen_amt, "\n%s regenerated %d HP!", c->name, regen_amt);
 
-    c->player_info->hp_regens_remaining--;
+    unsigned char payload[4] = {EVENT_REGEN, c == c->current_match->players[1], (regen_amt >> 8) & 0xff, regen_amt & 0xff};
+    spectate(c->current_match, MSG_WATCH_EVENT, payload, sizeof(payload), "\n%s regenerates %d HP!\n", c->name, regen_amt);
 }
 
 void speak(struct client *c, char *s) {
+    struct client *to = c->current_match->non_active_player;
     char msg[MAX_MSG_LEN];
-    sprintf(msg, "[%s]: %s\n", c->name, s);
-    broadcast_to_client(c->current_match->non_active_player, msg);
+
+    if (journal_fd != -1) {
+        journal_chat(c, s);
+    }
+
+    //u8 name length, name, text
+    size_t namelen = strlen(c->name);
+    size_t len = strlen(s);
+    if (1 + namelen + len > sizeof(msg)) {
+        len = sizeof(msg) - 1 - namelen;
+    }
+
+    msg[0] = namelen;
+    memcpy(msg + 1, c->name, namelen);
+    memcpy(msg + 1 + namelen, s, len);
+
+    //spectators hear it too
+    spectate(c->current_match, MSG_CHAT, msg, 1 + namelen + len, "[%s]: %s\n", c->name, s);
+
+    if (to->binary) {
+        queuebinary(to, MSG_CHAT, msg, 1 + namelen + len);
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "[%s]: %s\n", c->name, s);
+    broadcast_to_client(to, msg);
 }
 
 
 /*
-Returns the new head of the list (may be unchanged), or NULL if client c was not found
+Handles a command from client c in the lobby: (l)ist live matches, (w)atch one, or (q)uit watching
 */
-void moveclienttoendoflist(struct client *c) {
-    //the case where client c is the first client (top) simply means it is already at the end of the list, and so we don't do anything
+void lobbycommand(struct client *c, char cmd) {
+    if (cmd == 'l') {
+        listmatches(c);
+    }
+    else if (cmd == 'w') {
+        c->watch_prompt = 1;
+        broadcast_to_client(c, "\nWhose match? Type a player's name:\n");
+    }
+    else if (c->watching) {
+        stopwatching(c);
+        backtolobby(c);
+    }
+}
+
+/*
+Puts client c, who just stopped watching a match, back in the matchmaking queue
+*/
+void backtolobby(struct client *c) {
+    tellclient(c, MSG_WAITING, NULL, 0, "\nAwaiting opponent...\n");
+    enqueuewaiting(c);
+    matchclient(c);
+}
 
+/*
+Tells client c which matches are being played on its worker (the newest MAX_LISTED_MATCHES of them)
+*/
+void listmatches(struct client *c) {
+    char s[MAX_MSG_LEN];
+    int n = 0;
 
-    if (!c || !top)
-    {
-        perror("moveclienttoendoflist");
-        exit(1);
+    if (!live_matches) {
+        broadcast_to_client(c, "\nNo matches are being played right now.\n");
+        return;
     }
-    
 
-    if (c != top)
-    {
-        struct client *beforec;
-        for (beforec = top; beforec && beforec->next != c; beforec = beforec->next);
-        //beforec is now the client in the list just before client c
-        //OR beforec is NULL (in which case client c was not found in the list, and we raise error)
+    broadcast_to_client(c, "\nLive matches:\n");
+    for (struct match *match = live_matches; match && n < MAX_LISTED_MATCHES; match = match->next, n++) {
+        struct client *p0 = match->players[0];
+        struct client *p1 = match->players[1];
+        snprintf(s, sizeof(s), "  %s (%d) vs %s (%d), round %d, %d watching\n", p0->name, p0->rating, p1->name, p1->rating,
+                 match->round, match->text_spectators + match->binary_spectators);
+        broadcast_to_client(c, s);
+    }
 
-        if (!beforec)
-        {
+    if (live_match_count > MAX_LISTED_MATCHES) {
+        snprintf(s, sizeof(s), "  and %d more\n", live_match_count - MAX_LISTED_MATCHES);
+        broadcast_to_client(c, s);
+    }
+}
+
+/*
+Makes client c a spectator of the match the player called name is in, if that match is on c's worker
+*/
+void watchplayer(struct client *c, const char *name) {
+    //c may have been matched itself while typing the name
+    if (c->in_match) {
+        return;
+    }
+
+    //only players are worth comparing, and a worker has a lot fewer of them than connections
+    for (struct match *match = live_matches; match; match = match->next) {
+        if (strcmp(match->players[0]->name, name) == 0 || strcmp(match->players[1]->name, name) == 0) {
+            startwatching(c, match);
             return;
         }
+    }
+
+    char s[MAX_MSG_LEN];
+    snprintf(s, sizeof(s), "\n%.*s is not playing a match here.\n", MAX_NAME_LEN, name);
+    broadcast_to_client(c, s);
+}
+
+/*
+Composes what spectators see of match's state: the text (after the round banner if banner is 1) into f,
+and the MSG_WATCH_STATE payload into payload
+*/
+static void watchstate(struct match *match, int banner, struct frame *f, unsigned char *payload) {
+    struct client *p0 = match->players[0];
+    struct client *p1 = match->players[1];
+    int hp0 = p0->player_info->hp;
+    int hp1 = p1->player_info->hp;
+
+    f->len = 0;
+    if (banner) {
+        frame_printf(f, "---------------\nROUND %d\n---------------\n", match->round);
+    }
+    frame_printf(f, "%s: %d hp, %s: %d hp. %s to move\n", p0->name, hp0, p1->name, hp1, match->active_player->name);
+
+    payload[0] = (hp0 >> 8) & 0xff;
+    payload[1] = hp0 & 0xff;
+    payload[2] = (hp1 >> 8) & 0xff;
+    payload[3] = hp1 & 0xff;
+    payload[4] = (match->round >> 8) & 0xff;
+    payload[5] = match->round & 0xff;
+    payload[6] = (match->active_player == p1);
+}
+
+/*
+Adds client c to match's spectators, and sends it who is playing and how the match stands.
+c stops looking for an opponent until it stops watching
+*/
+void startwatching(struct client *c, struct match *match) {
+    if (c->watching == match) {
+        return;
+    }
+    stopwatching(c);
+    dequeuewaiting(c);
+
+    //what is in the match's stream happened before c arrived, c gets the current state below instead
+    flushstream(match);
+    linkspectator(c, match);
+
+    struct client *p0 = match->players[0];
+    struct client *p1 = match->players[1];
+    char s[MAX_MSG_LEN];
+
+    if (c->binary) {
+        //u8 length of player 0's name, both names
+        size_t len0 = strlen(p0->name);
+        size_t len1 = strlen(p1->name);
+        s[0] = len0;
+        memcpy(s + 1, p0->name, len0);
+        memcpy(s + 1 + len0, p1->name, len1);
+        queuebinary(c, MSG_WATCH_START, s, 1 + len0 + len1);
+    }
+    else {
+        snprintf(s, sizeof(s), "\nYou are watching %s (%d) vs %s (%d). (q)uit watching to play again\n", p0->name, p0->rating, p1->name, p1->rating);
+        queueoutput(c, s, strlen(s));
+    }
+
+    struct frame f;
+    unsigned char payload[WATCH_STATE_PAYLOAD_LEN];
+    watchstate(match, 1, &f, payload);
+    tellclient(c, MSG_WATCH_STATE, payload, sizeof(payload), f.data);
+}
+
+/*
+Adds client c to match's spectator list
+*/
+void linkspectator(struct client *c, struct match *match) {
+    c->watching = match;
+    c->spec_prev = NULL;
+    c->spec_next = match->spectators;
+    if (match->spectators) {
+        match->spectators->spec_prev = c;
+    }
+    match->spectators = c;
+
+    if (c->binary) {
+        match->binary_spectators++;
+    }
+    else {
+        match->text_spectators++;
+    }
+}
+
+/*
+Takes client c off the spectator list of the match it is watching, if any
+*/
+void stopwatching(struct client *c) {
+    struct match *match = c->watching;
+    if (!match) {
+        return;
+    }
+
+    if (c->spec_prev) {
+        c->spec_prev->spec_next = c->spec_next;
+    }
+    else {
+        match->spectators = c->spec_next;
+    }
+
+    if (c->spec_next) {
+        c->spec_next->spec_prev = c->spec_prev;
+    }
+
+    if (c->binary) {
+        match->binary_spectators--;
+    }
+    else {
+        match->text_spectators--;
+    }
+
+    c->watching = NULL;
+    c->spec_next = NULL;
+    c->spec_prev = NULL;
+}
+
+/*
+Appends len bytes from s to stream, one of match's streams, putting match on the worker's stream list if this is its first output
+*/
+static void streamappend(struct match *match, struct msgbuf **stream, const void *s, size_t len) {
+    //a full stream goes out now, and a new one starts
+    if (*stream && (*stream)->cap - (*stream)->len < len) {
+        flushstream(match);
+    }
+
+    if (*stream) {
+        memcpy((*stream)->data + (*stream)->len, s, len);
+        (*stream)->len += len;
+        return;
+    }
+
+    if (!match->stream_text && !match->stream_binary) {
+        match->stream_prev = NULL;
+        match->stream_next = stream_list;
+        if (stream_list) {
+            stream_list->stream_prev = match;
+        }
+        stream_list = match;
+    }
+    *stream = msg_new(s, len);
+}
+
+/*
+Adds an event to match's stream for its spectators: text formatted from fmt for text spectators, a frame of type
+with payload for binary ones. Each is only encoded if somebody watches with that protocol, and only ever once
+*/
+void spectate(struct match *match, int type, const void *payload, size_t len, const char *fmt, ...) {
+    if (match->text_spectators > 0) {
+        char s[MAX_FRAME_LEN];
+        va_list ap;
+
+        va_start(ap, fmt);
+        int n = vsnprintf(s, sizeof(s), fmt, ap);
+        va_end(ap);
+
+        if (n > 0) {
+            streamappend(match, &match->stream_text, s, (size_t) n < sizeof(s) ? (size_t) n : sizeof(s) - 1);
+        }
+    }
+
+    if (match->binary_spectators > 0) {
+        unsigned char frame[FRAME_HEADER_LEN + MAX_FRAME_LEN];
+
+        if (len > MAX_FRAME_LEN) {
+            len = MAX_FRAME_LEN;
+        }
+
+        frame[0] = (len + 1) >> 8;
+        frame[1] = (len + 1) & 0xff;
+        frame[2] = type;
+        memcpy(frame + FRAME_HEADER_LEN, payload, len);
+        streamappend(match, &match->stream_binary, frame, FRAME_HEADER_LEN + len);
+    }
+}
+
+/*
+Adds match's state to its stream, after the round banner if banner is 1
+*/
+void spectatestate(struct match *match, int banner) {
+    if (!match->spectators) {
+        return;
+    }
+
+    struct frame f;
+    unsigned char payload[WATCH_STATE_PAYLOAD_LEN];
+    watchstate(match, banner, &f, payload);
+    spectate(match, MSG_WATCH_STATE, payload, sizeof(payload), "%s", f.data);
+}
+
+/*
+Tells match's spectators how it ended (END_*), and puts them back in the matchmaking queue (endmatch matches them up)
+*/
+void spectateend(struct match *match, int reason) {
+    static const char *how[] = {"?", "knockout", "forfeit", "disconnect"};
+    unsigned char payload[2] = {match->winner == match->players[1], reason};
+
+    spectate(match, MSG_WATCH_END, payload, sizeof(payload), "\n%s beats %s (%s).\n\nAwaiting opponent...\n",
+             match->winner->name, match->loser->name, how[reason % 4]);
+    flushstream(match);
+
+    while (match->spectators) {
+        struct client *c = match->spectators;
+        stopwatching(c);
+        enqueuewaiting(c);
+        matchclient(c);
+    }
+}
+
+/*
+Queues match's streams on its spectators' output queues and empties them. Every spectator gets a reference to the same
+message, so the cost per spectator is one queue entry, however much happened
+*/
+void flushstream(struct match *match) {
+    if (!match->stream_text && !match->stream_binary) {
+        return;
+    }
+
+    for (struct client *c = match->spectators; c; c = c->spec_next) {
+        struct msgbuf *m = c->binary ? match->stream_binary : match->stream_text;
+        if (m) {
+            queuemsg(c, m);
+        }
+    }
+
+    if (match->stream_text) {
+        msg_release(match->stream_text);
+        match->stream_text = NULL;
+    }
+    if (match->stream_binary) {
+        msg_release(match->stream_binary);
+        match->stream_binary = NULL;
+    }
 
-        beforec->next = c->next;
-        c->next = top;
-        top = c;
+    if (match->stream_prev) {
+        match->stream_prev->stream_next = match->stream_next;
+    }
+    else {
+        stream_list = match->stream_next;
+    }
+
+    if (match->stream_next) {
+        match->stream_next->stream_prev = match->stream_prev;
+    }
+}
+
+/*
+Flushes the stream of every match that has something in it
+*/
+void flushstreams() {
+    while (stream_list) {
+        flushstream(stream_list);
+    }
+}
+
+/*
+Moves client c to the back of the matchmaking queue (queueing it if it wasn't waiting)
+*/
+void moveclienttoendoflist(struct client *c) {
+    if (!c)
+    {
+        perror("moveclienttoendoflist");
+        exit(1);
     }
 
-    //printf testing
-    // printf("\n");
-    // for (struct client* p = top; p; p = p->next)
-    // {
-    //     printf("%s\n", p->name);
-    // }
+    //a client that is being removed (e.g. dropped mid-match) doesn't go back in the queue
+    dequeuewaiting(c);
+    enqueuewaiting(c);
 }
 
 
-void displayinfo(struct client *c) {
+void displayinfo(struct client *c, struct frame *f) {
     //should obv only be called when client c is currently in a match
     struct client *opp = (c == c->current_match->active_player) ? c->current_match->non_active_player : c->current_match->active_player;
 
-    char s[MAX_MSG_LEN];
-    sprintf(s, "\nYour hitpoints: %d\nYour powermoves: %d\nYour HP regens: %d\n%s's hitpoints: %d\n\n", c->player_info->hp, c->player_info->powermoves_remaining, c->player_info->hp_regens_remaining, opp->name, opp->player_info->hp);
+    frame_printf(f, "\nYour hitpoints: %d\nYour powermoves: %d\nYour HP regens: %d\n%s's hitpoints: %d\n\n", c->player_info->hp, c->player_info->powermoves_remaining, c->player_info->hp_regens_remaining, opp->name, opp->player_info->hp);
 
     //only if client is not active player
     if (c->current_match->active_player != c)
     {
-        strcat(s, "Waiting for other player to strike...\n");
+        frame_printf(f, "Waiting for other player to strike...\n");
     }
-    
-    broadcast_to_client(c, s);
 }
 
-void displaymenu(struct client *c) {
+void displaymenu(struct client *c, struct frame *f) {
     //should obv only be called when client c is currently in a match
-    char s[200];
-    strcpy(s, "\n(a)ttack");
+    frame_printf(f, "\n(a)ttack");
     
     if (c->player_info->powermoves_remaining > 0)
     {
-        strcat(s, "\n(p)owermove");
+        frame_printf(f, "\n(p)owermove");
     }
 
     if (c->player_info->hp_regens_remaining > 0) {
-        strcat(s, "\n(r)egenerate healthpoints");
+        frame_printf(f, "\n(r)egenerate healthpoints");
     }
 
-    strcat(s, "\n(s)peak something\n");
-    
-    broadcast_to_client(c, s);
+    frame_printf(f, "\n(s)peak something\n");
+}
+
+/*
+Sends client c its display as one frame: with banner, the round banner first, then its status, and the menu if it is c's turn.
+binary clients get a state snapshot instead
+*/
+void displayplayer(struct client *c, int banner) {
+    if (c->binary) {
+        sendstate(c);
+        return;
+    }
+
+    struct frame f;
+    f.len = 0;
+
+    if (banner) {
+        frame_printf(&f, "---------------\nROUND %d\n---------------\n", c->current_match->round);
+    }
+
+    displayinfo(c, &f);
+    if (c->current_match->active_player == c) {
+        displaymenu(c, &f);
+    }
+
+    sendframe(c, &f);
 }
 
 /*
@@ -824,13 +5882,36 @@ if mode 2, update for inactive player
 void updatedisplay(struct match *match, int mode) {
     if (mode == 0 || mode == 1)
     {
-        displayinfo(match->active_player);
-        displaymenu(match->active_player);
+        displayplayer(match->active_player, 0);
     }
     
     if (mode == 0 || mode == 2)
     {
-        displayinfo(match->non_active_player);
+        displayplayer(match->non_active_player, 0);
+    }
+}
+
+/*
+Appends formatted text to frame f, truncating at MAX_FRAME_LEN
+*/
+void frame_printf(struct frame *f, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(f->data + f->len, sizeof(f->data) - f->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0) {
+        f->len += ((size_t) n < sizeof(f->data) - f->len) ? (size_t) n : sizeof(f->data) - f->len - 1;
+    }
+}
+
+/*
+Queues frame f for client c as a single message (nothing if it is empty)
+*/
+void sendframe(struct client *c, struct frame *f) {
+    if (f->len > 0) {
+        queueoutput(c, f->data, f->len);
     }
 }
 
@@ -855,12 +5936,13 @@ void switchturn(struct match *match) {
     match->non_active_player = tmp;
     match->round++;
 
-    char s[200];
-    sprintf(s, "---------------\nROUND %d\n---------------\n", match->round);
-
-    broadcast_to_client(match->active_player, s);
-    broadcast_to_client(match->non_active_player, s);
+    //the new active player's clock starts now
+    if (turn_timeout > 0) {
+        timer_arm(&match->turn_timer, turn_timeout * 1000UL);
+    }
 
-    //display
-    updatedisplay(match, 0);
+    //the round banner and both displays go out as one frame per player
+    displayplayer(match->active_player, 1);
+    displayplayer(match->non_active_player, 1);
+    spectatestate(match, 1);
 }
\ No newline at end of file
@@ -0,0 +1,500 @@
+/*
+ * microbenchmarks for the battle server's core operations:
+ * includes battle.c and drives registername, findopponent, matchloneclients, moveclienttoendoflist, broadcast_all
+ * and switchturn directly on one worker, with 1, 100, 10k and 100k clients. The clients aren't connected to anything:
+ * whatever is queued for them is dropped after every operation (a null sink), so only the server's own work is timed,
+ * not the kernel's. Prints ns/op, heap allocations/op (malloc, calloc and realloc, including libc's own) and pool
+ * allocations/op, so that a change which makes any of them slower or allocate more shows up in the numbers.
+ *
+ * Linux only (glibc, whose malloc a program may replace).
+*/
+
+#define BATTLE_NO_MAIN
+#include "battle.c"
+
+#include <sys/resource.h>
+
+#define BENCH_CLIENTS "1,100,10000,100000"
+#define BENCH_TIME_MS 200 //how long each benchmark runs at each client count
+#define BENCH_BATCH 256 //operations timed together when nothing has to happen between them
+#define BENCH_MAX_FD_BASE (1 << 20)
+
+//an operation to time. setup builds the worker's state around n clients. prep and undo (either may be NULL) run
+//untimed before and after every operation: prep to set up what op needs, undo to put the state back as it was
+struct benchmark {
+    const char *name;
+    void (*setup)(int n);
+    void (*prep)();
+    void (*op)();
+    void (*undo)();
+};
+
+void usage(char *prog);
+void runbenchmark(struct benchmark *b, int n);
+unsigned long poolallocs();
+unsigned long clockoverhead();
+struct client *benchclient(int registered);
+void benchdrop(struct client *c);
+void benchunmatch(struct match *match);
+void benchreset();
+void drainoutput();
+void setup_lobby(int n);
+void setup_queue(int n);
+void setup_matches(int n);
+void prep_newclient();
+void op_registername();
+void undo_newclient();
+void op_findopponent();
+void op_matchloneclients();
+void undo_matches();
+void op_moveclienttoendoflist();
+void op_broadcast_all();
+void op_switchturn();
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static struct benchmark benchmarks[] = {
+    {"registername", setup_lobby, prep_newclient, op_registername, undo_newclient},
+    {"findopponent", setup_queue, NULL, op_findopponent, NULL},
+    {"matchloneclients", setup_queue, NULL, op_matchloneclients, undo_matches},
+    {"moveclienttoendoflist", setup_queue, NULL, op_moveclienttoendoflist, NULL},
+    {"broadcast_all", setup_lobby, NULL, op_broadcast_all, drainoutput},
+    {"switchturn", setup_matches, NULL, op_switchturn, drainoutput},
+};
+
+//settings
+static int bench_time_ms = BENCH_TIME_MS;
+static int bench_binary = 0;
+static const char *bench_only = NULL;
+
+//heap allocations so far. the benchmarks run on one thread, and nothing else allocates while they do
+static unsigned long heap_allocs = 0;
+
+//the clients (and matches) the current benchmark works on
+static struct client **bench_clients = NULL;
+static int bench_count = 0;
+static struct match **bench_matches = NULL;
+static int bench_match_count = 0;
+static struct client *bench_new = NULL; //registername's client
+static unsigned long bench_next = 0; //which client or match the next operation picks
+static unsigned long bench_serial = 0; //makes registername's names unique
+static uint64_t bench_seed = 1;
+
+//clients get made-up descriptors above anything the process can open, so one that ever reached a system call would
+//fail with EBADF instead of writing somewhere
+static int fd_base;
+static int fd_next;
+
+void *malloc(size_t size) {
+    heap_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    heap_allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    heap_allocs++;
+    return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+    __libc_free(p);
+}
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [--clients N,N,...] [--time MS] [--binary] [--only NAME]\n", prog);
+    fprintf(stderr, "  --clients N,N,...   client counts to run every benchmark with (default %s)\n", BENCH_CLIENTS);
+    fprintf(stderr, "  --time MS           how long each benchmark runs at each client count (default %d)\n", BENCH_TIME_MS);
+    fprintf(stderr, "  --binary            clients use the binary protocol\n");
+    fprintf(stderr, "  --only NAME         run just the named benchmark\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt;
+    char default_counts[] = BENCH_CLIENTS;
+    char *counts = default_counts; //strtok_r writes to it
+
+    static struct option long_options[] = {
+        {"clients", required_argument, NULL, 'c'},
+        {"time", required_argument, NULL, 't'},
+        {"binary", no_argument, NULL, 'b'},
+        {"only", required_argument, NULL, 'o'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            counts = optarg;
+            break;
+        case 't':
+            bench_time_ms = atoi(optarg);
+            break;
+        case 'b':
+            bench_binary = 1;
+            break;
+        case 'o':
+            bench_only = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc || bench_time_ms < 1) {
+        usage(argv[0]);
+    }
+
+    //one worker, on this thread, without a reactor: nothing here waits for events
+    shards = calloc(1, sizeof(struct shard));
+    shard = &shards[0];
+    worker_count = 1;
+    client_count = malloc(sizeof(int));
+    *client_count = 0;
+    server_start_ns = nowns();
+    timer_start();
+    timer_init(&matchmaking_timer, matchmakingretry, NULL);
+    seed_source = bench_seed;
+    log_level = LOG_WARN; //a warning (e.g. an output queue over its limit) means the benchmark is broken
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > BENCH_MAX_FD_BASE) {
+        fd_base = BENCH_MAX_FD_BASE;
+    }
+    else {
+        fd_base = rl.rlim_cur;
+    }
+
+    //the client counts, checked before anything runs
+    int ns[64];
+    int n_count = 0;
+    char *saveptr;
+    char *s;
+    for (s = strtok_r(counts, ",", &saveptr); s; s = strtok_r(NULL, ",", &saveptr)) {
+        if (n_count == (int) (sizeof(ns) / sizeof(ns[0])) || (ns[n_count++] = atoi(s)) < 1) {
+            fprintf(stderr, "bad client count %s\n", s);
+            usage(argv[0]);
+        }
+    }
+
+    int found = 0;
+    for (i = 0; i < (int) (sizeof(benchmarks) / sizeof(benchmarks[0])); i++) {
+        found |= !bench_only || strcmp(bench_only, benchmarks[i].name) == 0;
+    }
+    if (!found || n_count == 0) {
+        fprintf(stderr, n_count ? "unknown benchmark %s\n" : "no client counts\n", bench_only);
+        usage(argv[0]);
+    }
+
+    printf("%-22s %8s %10s %12s %11s %15s\n", "benchmark", "clients", "ops", "ns/op", "mallocs/op", "pool allocs/op");
+
+    for (i = 0; i < (int) (sizeof(benchmarks) / sizeof(benchmarks[0])); i++) {
+        if (bench_only && strcmp(bench_only, benchmarks[i].name) != 0) {
+            continue;
+        }
+
+        int j;
+        for (j = 0; j < n_count; j++) {
+            runbenchmark(&benchmarks[i], ns[j]);
+        }
+    }
+
+    return 0;
+}
+
+/*
+Runs benchmark b with n clients for bench_time_ms (after a tenth of that to warm up, e.g. to grow the pools),
+and prints a line of results
+*/
+void runbenchmark(struct benchmark *b, int n) {
+    unsigned long overhead = clockoverhead();
+    unsigned long budget = bench_time_ms * 1000000UL;
+    unsigned long ops = 0, timed = 0, heap = 0, pooled = 0;
+    int batch = (b->prep || b->undo) ? 1 : BENCH_BATCH;
+    int warm, i;
+
+    b->setup(n);
+
+    for (warm = 1; warm >= 0; warm--) {
+        unsigned long start = nowns();
+        unsigned long limit = warm ? budget / 10 : budget;
+
+        ops = timed = heap = pooled = 0;
+        while (ops == 0 || nowns() - start < limit) {
+            if (b->prep) {
+                b->prep();
+            }
+
+            unsigned long h = heap_allocs;
+            unsigned long p = poolallocs();
+            unsigned long t = nowns();
+            for (i = 0; i < batch; i++) {
+                b->op();
+            }
+            t = nowns() - t;
+            heap += heap_allocs - h;
+            pooled += poolallocs() - p;
+            timed += t > overhead ? t - overhead : 0;
+
+            if (b->undo) {
+                b->undo();
+            }
+            ops += batch;
+        }
+    }
+
+    printf("%-22s %8d %10lu %12.1f %11.2f %15.2f\n", b->name, bench_count, ops, (double) timed / ops,
+           (double) heap / ops, (double) pooled / ops);
+    fflush(stdout);
+
+    benchreset();
+}
+
+/*
+returns how many objects this worker has taken from its pools so far
+*/
+unsigned long poolallocs() {
+    return client_pool.allocs + bufferinfo_pool.allocs + match_pool.allocs + player_info_pool.allocs +
+           outchunk_pool.allocs + msgbuf_pool.allocs;
+}
+
+/*
+returns what reading the clock twice costs, which runbenchmark takes off every timed stretch
+*/
+unsigned long clockoverhead() {
+    unsigned long best = ~0UL;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        unsigned long t = nowns();
+        t = nowns() - t;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+/*
+Adds a client to the worker and to bench_clients, the way acceptclients would, and registers a name for it if
+registered is set (without announcing it or queueing it, which registername would)
+*/
+struct client *benchclient(int registered) {
+    struct in_addr addr;
+    char name[MAX_NAME_LEN];
+
+    addr.s_addr = htonl(INADDR_LOOPBACK);
+    struct client *c = addclient(fd_base + fd_next++, addr);
+    c->binary = bench_binary;
+
+    if (registered) {
+        snprintf(name, sizeof(name), "bench%d", bench_count);
+        pthread_mutex_lock(&name_index_lock);
+        c->name = nameindex_insert(name);
+        pthread_mutex_unlock(&name_index_lock);
+        c->name_registered = 1;
+    }
+
+    bench_clients = realloc(bench_clients, (bench_count + 1) * sizeof(struct client *));
+    bench_clients[bench_count++] = c;
+    return c;
+}
+
+/*
+Takes client c off the worker again without telling anybody, as far as it got (no match, though)
+*/
+void benchdrop(struct client *c) {
+    dequeuewaiting(c);
+    timer_cancel(&c->deadline);
+    clearoutput(c);
+
+    if (c->flush_pending) {
+        drainoutput();
+    }
+
+    if (c->name_registered) {
+        pthread_mutex_lock(&name_index_lock);
+        nameindex_remove(c->name);
+        pthread_mutex_unlock(&name_index_lock);
+    }
+
+    unlinkclient(c);
+    clients_by_fd[c->fd] = NULL;
+    pool_free(&client_pool, c);
+    (*client_count)--;
+}
+
+/*
+Returns match and both players' per-match state to their pools, leaving the players out of the queue with no last opponent
+*/
+void benchunmatch(struct match *match) {
+    int i;
+
+    timer_cancel(&match->turn_timer);
+    for (i = 0; i < 2; i++) {
+        struct client *c = match->players[i];
+        c->in_match = 0;
+        c->current_match = NULL;
+        c->client_just_played = NULL;
+        pool_free(&player_info_pool, c->player_info);
+        c->player_info = NULL;
+    }
+    unlinkmatch(match);
+    pool_free(&match_pool, match);
+}
+
+/*
+Drops every client and match the last benchmark made, so the next one starts from an empty worker
+*/
+void benchreset() {
+    int i;
+
+    drainoutput();
+    for (i = 0; i < bench_count; i++) {
+        struct client *c = bench_clients[i];
+        if (c->in_match && c == c->current_match->players[0]) {
+            benchunmatch(c->current_match);
+        }
+    }
+    for (i = 0; i < bench_count; i++) {
+        benchdrop(bench_clients[i]);
+    }
+    timer_cancel(&matchmaking_timer);
+
+    free(bench_clients);
+    free(bench_matches);
+    bench_clients = NULL;
+    bench_matches = NULL;
+    bench_count = bench_match_count = 0;
+    bench_next = 0;
+    fd_next = 0;
+}
+
+/*
+The null sink: drops everything queued for every client since the last call
+*/
+void drainoutput() {
+    while (flush_list) {
+        struct client *c = flush_list;
+        flush_list = c->flush_next;
+
+        c->flush_pending = 0;
+        c->flush_next = NULL;
+        clearoutput(c);
+    }
+}
+
+/*
+n registered clients, none of them waiting (e.g. all in matches): who a broadcast goes to
+*/
+void setup_lobby(int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        benchclient(1);
+    }
+}
+
+/*
+n registered clients in the matchmaking queue, with ratings spread over 1100 to 1900
+*/
+void setup_queue(int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        struct client *c = benchclient(1);
+        c->rating = RATING_INITIAL - 400 + splitmix64(&bench_seed) % 801;
+        enqueuewaiting(c);
+    }
+}
+
+/*
+n clients (at least 2) paired up in matches, with their opening output dropped
+*/
+void setup_matches(int n) {
+    int i;
+
+    if (n < 2) {
+        n = 2;
+    }
+    setup_lobby(n);
+
+    bench_matches = malloc((n / 2) * sizeof(struct match *));
+    for (i = 0; i + 1 < n; i += 2) {
+        bench_matches[bench_match_count++] = creatematch(bench_clients[i], bench_clients[i + 1]);
+    }
+    drainoutput();
+}
+
+void prep_newclient() {
+    bench_new = benchclient(0);
+}
+
+//a new client picks a name, with n - 1 others already in the arena to tell about it
+void op_registername() {
+    char name[MAX_NAME_LEN];
+
+    snprintf(name, sizeof(name), "new%lu", bench_serial++);
+    registername(bench_new, name);
+}
+
+void undo_newclient() {
+    drainoutput();
+    benchdrop(bench_new);
+    bench_clients[--bench_count] = NULL;
+    fd_next--;
+}
+
+//one waiting client looks for an opponent among n
+void op_findopponent() {
+    findopponent(bench_clients[bench_next++ % bench_count]);
+}
+
+//n waiting clients get paired up (all but a few, with ratings too far apart, end up in matches)
+void op_matchloneclients() {
+    matchloneclients();
+}
+
+//every match ends, and the clients go back into the queue in their original order
+void undo_matches() {
+    int i;
+
+    drainoutput();
+    for (i = 0; i < bench_count; i++) {
+        struct client *c = bench_clients[i];
+        if (c->in_match && c == c->current_match->players[0]) {
+            benchunmatch(c->current_match);
+        }
+    }
+    for (i = 0; i < bench_count; i++) {
+        dequeuewaiting(bench_clients[i]);
+    }
+    for (i = 0; i < bench_count; i++) {
+        enqueuewaiting(bench_clients[i]);
+    }
+    timer_cancel(&matchmaking_timer);
+}
+
+//the longest waiting of n clients goes to the back of the queue
+void op_moveclienttoendoflist() {
+    moveclienttoendoflist(wait_head);
+}
+
+//an announcement goes out to all n clients (the server sends it, so nobody is left out)
+void op_broadcast_all() {
+    static char msg[] = "\n**somebody enters the arena**\n";
+    broadcast_all(NULL, msg, sizeof(msg) - 1);
+}
+
+//a move is over in one of n / 2 matches: the next round is rendered for both players
+void op_switchturn() {
+    switchturn(bench_matches[bench_next++ % bench_match_count]);
+}
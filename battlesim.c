@@ -0,0 +1,459 @@
+/*
+ * offline battle simulator, for balance tuning:
+ * plays bot-vs-bot matches with the server's combat engine (engine.h), on every core, and reports
+ * win rates, first-mover advantage and the match length distribution for a set of rules.
+ *
+ * Each thread plays SIM_LANES matches side by side. Their generators live in columns (one array per
+ * xoshiro state word), so drawing the next words for every lane is one loop the compiler vectorizes.
+ * A lane that finishes its match starts the next one right away. Since the engine draws the same words
+ * per move as the server does, a simulated match plays out exactly like a server match with that seed
+ * and those moves.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "engine.h"
+
+#define SIM_LANES 16 //matches each thread plays side by side
+#define MAX_ROUNDS 1000 //a match still going after this many rounds is a draw
+#define ROUND_BUCKETS 256 //match length histogram, the last bucket takes every longer match
+#define MAX_THREADS 256
+
+//how a bot picks its move
+enum {
+    POLICY_ATTACK, //always attacks
+    POLICY_POWER, //powermoves while it has any, then attacks
+    POLICY_GREEDY, //regenerates when one powermove could kill it, otherwise powermoves while it can
+    POLICY_RANDOM, //any move it has left, uniformly
+    POLICY_COUNT
+};
+
+struct results {
+    unsigned long matches;
+    unsigned long wins[2]; //by player (policy) index
+    unsigned long first_mover_wins;
+    unsigned long draws;
+    unsigned long total_rounds;
+    unsigned long rounds[ROUND_BUCKETS];
+};
+
+//SIM_LANES matches in flight. generator state and draws are stored by column so draw() vectorizes
+struct lanes {
+    uint64_t s0[SIM_LANES];
+    uint64_t s1[SIM_LANES];
+    uint64_t s2[SIM_LANES];
+    uint64_t s3[SIM_LANES];
+    uint64_t r1[SIM_LANES];
+    uint64_t r2[SIM_LANES];
+
+    struct player_info players[SIM_LANES][2];
+    int active[SIM_LANES]; //0 or 1, whose move it is
+    int first[SIM_LANES]; //who moved first
+    int round[SIM_LANES];
+    int live[SIM_LANES]; //0 once the lane has no more matches to play
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    unsigned long matches; //how many to play
+    struct results results;
+};
+
+void usage(char *prog);
+int parsepolicy(const char *s);
+void parserange(const char *s, int *lo, int *hi, char *prog);
+void *runsim(void *arg);
+void draw(struct lanes *l, uint64_t *out);
+void startlane(struct lanes *l, int i, uint64_t *seed_source);
+int choosemove(int policy, uint64_t r, const struct player_info *self);
+unsigned long percentile(const struct results *r, double p);
+
+//settings
+static struct engine_rules rules = ENGINE_DEFAULT_RULES;
+static unsigned long match_count = 10000000;
+static int thread_count = 0; //0 for one per online cpu
+static uint64_t seed = 1;
+static int policies[2] = {POLICY_GREEDY, POLICY_GREEDY};
+static int show_histogram = 0;
+
+static const char *policy_names[POLICY_COUNT] = {"attack", "power", "greedy", "random"};
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [--matches N] [--threads N] [--seed N] [--policy0 P] [--policy1 P] [--histogram]\n"
+                    "          [--hp LO,HI] [--dmg LO,HI] [--powermoves LO,HI] [--multiplier N] [--chance N] [--regen LO,HI] [--regens LO,HI]\n", prog);
+    fprintf(stderr, "  --matches N         matches to play (default %lu)\n", match_count);
+    fprintf(stderr, "  --threads N         threads to play them on (default: one per online cpu)\n");
+    fprintf(stderr, "  --seed N            where match seeds come from (default %llu)\n", (unsigned long long) seed);
+    fprintf(stderr, "  --policy0 P         how player 0 plays: attack, power, greedy or random (default greedy)\n");
+    fprintf(stderr, "  --policy1 P         how player 1 plays (default greedy)\n");
+    fprintf(stderr, "  --histogram         print the whole match length distribution\n");
+    fprintf(stderr, "  --hp LO,HI          starting hp range (default %d,%d)\n", HP_MIN, HP_MAX);
+    fprintf(stderr, "  --dmg LO,HI         attack damage range (default %d,%d)\n", REGULAR_DMG_MIN, REGULAR_DMG_MAX);
+    fprintf(stderr, "  --powermoves LO,HI  powermoves per player (default %d,%d)\n", POWERMOVE_COUNT_MIN, POWERMOVE_COUNT_MAX);
+    fprintf(stderr, "  --multiplier N      powermove damage multiplier (default %d)\n", POWERMOVE_DMG_MULTIPLIER);
+    fprintf(stderr, "  --chance N          a powermove lands one time in N (default %d)\n", POWERMOVE_CHANCE);
+    fprintf(stderr, "  --regen LO,HI       hp regenerated per regen (default %d,%d)\n", HP_REGEN_MIN, HP_REGEN_MAX);
+    fprintf(stderr, "  --regens LO,HI      regens per player (default %d,%d)\n", HP_REGEN_COUNT_MIN, HP_REGEN_COUNT_MAX);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt;
+
+    static struct option long_options[] = {
+        {"matches", required_argument, NULL, 'n'},
+        {"threads", required_argument, NULL, 't'},
+        {"seed", required_argument, NULL, 's'},
+        {"policy0", required_argument, NULL, '0'},
+        {"policy1", required_argument, NULL, '1'},
+        {"histogram", no_argument, NULL, 'H'},
+        {"hp", required_argument, NULL, 'h'},
+        {"dmg", required_argument, NULL, 'd'},
+        {"powermoves", required_argument, NULL, 'p'},
+        {"multiplier", required_argument, NULL, 'm'},
+        {"chance", required_argument, NULL, 'c'},
+        {"regen", required_argument, NULL, 'r'},
+        {"regens", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n':
+            match_count = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            thread_count = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case '0':
+        case '1':
+            if ((policies[opt - '0'] = parsepolicy(optarg)) == -1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'H':
+            show_histogram = 1;
+            break;
+        case 'h':
+            parserange(optarg, &rules.hp_min, &rules.hp_max, argv[0]);
+            break;
+        case 'd':
+            parserange(optarg, &rules.dmg_min, &rules.dmg_max, argv[0]);
+            break;
+        case 'p':
+            parserange(optarg, &rules.powermove_count_min, &rules.powermove_count_max, argv[0]);
+            break;
+        case 'm':
+            rules.powermove_multiplier = atoi(optarg);
+            break;
+        case 'c':
+            rules.powermove_chance = atoi(optarg);
+            break;
+        case 'r':
+            parserange(optarg, &rules.regen_min, &rules.regen_max, argv[0]);
+            break;
+        case 'R':
+            parserange(optarg, &rules.regen_count_min, &rules.regen_count_max, argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || match_count == 0 || rules.hp_min < 1 || rules.dmg_min < 0 || rules.powermove_count_min < 0
+        || rules.powermove_multiplier < 0 || rules.powermove_chance < 1 || rules.regen_min < 0 || rules.regen_count_min < 0) {
+        usage(argv[0]);
+    }
+
+    if (thread_count <= 0) {
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+    if (thread_count > MAX_THREADS) {
+        thread_count = MAX_THREADS;
+    }
+
+    struct worker *workers = calloc(thread_count, sizeof(struct worker));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (i = 0; i < thread_count; i++) {
+        workers[i].id = i;
+        workers[i].matches = match_count / thread_count + ((unsigned long) i < match_count % thread_count);
+
+        if (pthread_create(&workers[i].thread, NULL, runsim, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    struct results total;
+    memset(&total, 0, sizeof(total));
+
+    for (i = 0; i < thread_count; i++) {
+        struct results *r = &workers[i].results;
+        int b;
+
+        pthread_join(workers[i].thread, NULL);
+
+        total.matches += r->matches;
+        total.wins[0] += r->wins[0];
+        total.wins[1] += r->wins[1];
+        total.first_mover_wins += r->first_mover_wins;
+        total.draws += r->draws;
+        total.total_rounds += r->total_rounds;
+        for (b = 0; b < ROUND_BUCKETS; b++) {
+            total.rounds[b] += r->rounds[b];
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double n = total.matches;
+
+    printf("matches %lu in %.2fs (%.0f matches/s, %d threads)\n", total.matches, secs, secs > 0 ? n / secs : 0, thread_count);
+    printf("player 0 (%s) wins %.2f%%, player 1 (%s) wins %.2f%%, draws %.2f%%\n",
+           policy_names[policies[0]], 100 * total.wins[0] / n, policy_names[policies[1]], 100 * total.wins[1] / n, 100 * total.draws / n);
+    printf("first mover wins %.2f%% of decided matches\n",
+           total.wins[0] + total.wins[1] ? 100.0 * total.first_mover_wins / (total.wins[0] + total.wins[1]) : 0);
+    printf("rounds: mean %.2f, p50 %lu, p90 %lu, p99 %lu, p999 %lu\n", total.total_rounds / n,
+           percentile(&total, 0.5), percentile(&total, 0.9), percentile(&total, 0.99), percentile(&total, 0.999));
+
+    if (show_histogram) {
+        int b;
+        for (b = 0; b < ROUND_BUCKETS; b++) {
+            if (total.rounds[b]) {
+                printf("%s%3d rounds: %10lu %6.2f%%\n", b == ROUND_BUCKETS - 1 ? ">=" : "  ", b, total.rounds[b], 100 * total.rounds[b] / n);
+            }
+        }
+    }
+
+    free(workers);
+    return 0;
+}
+
+/*
+returns the POLICY_* named s, or -1
+*/
+int parsepolicy(const char *s) {
+    int i;
+
+    for (i = 0; i < POLICY_COUNT; i++) {
+        if (strcmp(s, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Parses "LO,HI" into lo and hi, or exits with the usage message
+*/
+void parserange(const char *s, int *lo, int *hi, char *prog) {
+    if (sscanf(s, "%d,%d", lo, hi) != 2 || *lo > *hi) {
+        fprintf(stderr, "bad range %s\n", s);
+        usage(prog);
+    }
+}
+
+/*
+A simulator thread: plays its share of the matches and tallies them in its results
+*/
+void *runsim(void *arg) {
+    struct worker *w = arg;
+    struct results *res = &w->results;
+    struct lanes *l = calloc(1, sizeof(struct lanes));
+    unsigned long started = 0;
+    int i, live = 0;
+
+    if (!l) {
+        perror("calloc");
+        exit(1);
+    }
+
+    //each thread draws match seeds from its own stream (see the server's runworker)
+    uint64_t thread_seed = seed + w->id;
+    uint64_t seed_source = splitmix64(&thread_seed);
+
+    for (i = 0; i < SIM_LANES && started < w->matches; i++) {
+        startlane(l, i, &seed_source);
+        started++;
+        live++;
+    }
+
+    while (live > 0) {
+        //every move draws ENGINE_MOVE_DRAWS words, so all lanes can draw together
+        draw(l, l->r1);
+        draw(l, l->r2);
+
+        for (i = 0; i < SIM_LANES; i++) {
+            if (!l->live[i]) {
+                continue;
+            }
+
+            int a = l->active[i];
+            struct player_info *self = &l->players[i][a];
+            struct player_info *opp = &l->players[i][!a];
+            int move = choosemove(policies[a], l->r2[i], self);
+
+            engine_move(&rules, move, l->r1[i], l->r2[i], self, opp);
+
+            //a regen doesn't end the turn (same as the server)
+            if (move == MOVE_REGEN) {
+                continue;
+            }
+
+            l->round[i]++;
+
+            int over = opp->hp <= 0 || l->round[i] >= MAX_ROUNDS;
+            if (!over) {
+                l->active[i] = !a;
+                continue;
+            }
+
+            res->matches++;
+            res->total_rounds += l->round[i];
+            res->rounds[l->round[i] < ROUND_BUCKETS ? l->round[i] : ROUND_BUCKETS - 1]++;
+            if (opp->hp <= 0) {
+                res->wins[a]++;
+                res->first_mover_wins += a == l->first[i];
+            }
+            else {
+                res->draws++;
+            }
+
+            if (started < w->matches) {
+                startlane(l, i, &seed_source);
+                started++;
+            }
+            else {
+                l->live[i] = 0;
+                live--;
+            }
+        }
+    }
+
+    free(l);
+    return NULL;
+}
+
+/*
+Stores the next xoshiro256** output of every lane in out. Same steps as rng_next, one column at a time
+*/
+void draw(struct lanes *l, uint64_t *out) {
+    int i;
+
+    for (i = 0; i < SIM_LANES; i++) {
+        uint64_t s0 = l->s0[i], s1 = l->s1[i], s2 = l->s2[i], s3 = l->s3[i];
+        uint64_t t = s1 << 17;
+
+        out[i] = rotl(s1 * 5, 7) * 9;
+
+        s2 ^= s0;
+        s3 ^= s1;
+        s1 ^= s2;
+        s0 ^= s3;
+        s2 ^= t;
+        s3 = rotl(s3, 45);
+
+        l->s0[i] = s0;
+        l->s1[i] = s1;
+        l->s2[i] = s2;
+        l->s3[i] = s3;
+    }
+}
+
+/*
+Starts a new match in lane i, with the next seed from seed_source
+*/
+void startlane(struct lanes *l, int i, uint64_t *seed_source) {
+    struct engine_setup setup;
+    struct rng r;
+
+    rng_seed(&r, splitmix64(seed_source));
+    engine_start(&rules, &r, &setup);
+
+    l->s0[i] = r.s[0];
+    l->s1[i] = r.s[1];
+    l->s2[i] = r.s[2];
+    l->s3[i] = r.s[3];
+
+    int p;
+    for (p = 0; p < 2; p++) {
+        l->players[i][p].hp = setup.hp[p];
+        l->players[i][p].powermoves_remaining = setup.powermoves;
+        l->players[i][p].hp_regens_remaining = setup.regens;
+    }
+
+    l->active[i] = !setup.starting_player; //see struct engine_setup
+    l->first[i] = l->active[i];
+    l->round[i] = 0;
+    l->live[i] = 1;
+}
+
+/*
+returns the move a bot playing policy makes, given its state. r is only used by POLICY_RANDOM (its low bits,
+which engine_move doesn't look at)
+*/
+int choosemove(int policy, uint64_t r, const struct player_info *self) {
+    switch (policy) {
+    case POLICY_POWER:
+        return self->powermoves_remaining > 0 ? MOVE_POWERMOVE : MOVE_ATTACK;
+    case POLICY_GREEDY:
+        if (self->hp_regens_remaining > 0 && self->hp <= rules.dmg_max * rules.powermove_multiplier) {
+            return MOVE_REGEN;
+        }
+        return self->powermoves_remaining > 0 ? MOVE_POWERMOVE : MOVE_ATTACK;
+    case POLICY_RANDOM: {
+        int moves[3], n = 0;
+        moves[n++] = MOVE_ATTACK;
+        if (self->powermoves_remaining > 0) {
+            moves[n++] = MOVE_POWERMOVE;
+        }
+        if (self->hp_regens_remaining > 0) {
+            moves[n++] = MOVE_REGEN;
+        }
+        return moves[(r & 0xffff) % n];
+    }
+    default:
+        return MOVE_ATTACK;
+    }
+}
+
+/*
+returns the match length (in rounds) at fraction p of the distribution in r, nearest rank
+*/
+unsigned long percentile(const struct results *r, double p) {
+    unsigned long rank = (unsigned long) (p * r->matches + 0.5);
+    unsigned long seen = 0;
+    int b;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (b = 0; b < ROUND_BUCKETS; b++) {
+        seen += r->rounds[b];
+        if (seen >= rank) {
+            return b;
+        }
+    }
+    return ROUND_BUCKETS - 1;
+}
@@ -0,0 +1,208 @@
+/*
+ * combat engine: the rules of a match, with no I/O.
+ *
+ * Shared by the server and the offline simulator (battlesim). Everything random comes from a
+ * per-match xoshiro256** generator, in a fixed order: engine_setup draws ENGINE_SETUP_DRAWS words,
+ * and every move draws exactly ENGINE_MOVE_DRAWS words whether it uses them or not. That keeps
+ * matches replayable from their seed, and lets the simulator draw for many matches in lockstep.
+*/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+
+//default rules (see struct engine_rules)
+#define HP_MIN 20
+#define HP_MAX 30
+
+#define REGULAR_DMG_MIN 2
+#define REGULAR_DMG_MAX 6
+
+#define POWERMOVE_COUNT_MIN 1
+#define POWERMOVE_COUNT_MAX 3
+#define POWERMOVE_DMG_MULTIPLIER 3 //powermove is just regular dmg (generated randomly) multiplied by the multiplier
+#define POWERMOVE_CHANCE 2 //2 means chance of powermove is 1/2, or 50%. If it was 3, it would be 1/3, or 33%, and so on...
+
+#define HP_REGEN_MIN 3 //min amount of regeneration
+#define HP_REGEN_MAX 10 //max amount of regeneration
+#define HP_REGEN_COUNT_MIN 1
+#define HP_REGEN_COUNT_MAX 3
+
+#define ENGINE_DEFAULT_RULES {HP_MIN, HP_MAX, REGULAR_DMG_MIN, REGULAR_DMG_MAX, POWERMOVE_COUNT_MIN, POWERMOVE_COUNT_MAX, \
+                              POWERMOVE_DMG_MULTIPLIER, POWERMOVE_CHANCE, HP_REGEN_MIN, HP_REGEN_MAX, HP_REGEN_COUNT_MIN, HP_REGEN_COUNT_MAX}
+
+#define ENGINE_SETUP_DRAWS 5
+#define ENGINE_MOVE_DRAWS 2
+
+//moves, the same letters players type
+#define MOVE_ATTACK 'a'
+#define MOVE_POWERMOVE 'p'
+#define MOVE_REGEN 'r'
+
+#define ENGINE_MISSED -1 //engine_move result for a powermove that missed
+
+//every tunable number in a match. ranges are inclusive
+struct engine_rules {
+    int hp_min;
+    int hp_max;
+    int dmg_min;
+    int dmg_max;
+    int powermove_count_min;
+    int powermove_count_max;
+    int powermove_multiplier;
+    int powermove_chance; //a powermove lands one time in powermove_chance
+    int regen_min;
+    int regen_max;
+    int regen_count_min;
+    int regen_count_max;
+};
+
+//a player's state in a match
+struct player_info {
+    int hp; //healthpoints
+    int powermoves_remaining;
+    int hp_regens_remaining;
+};
+
+//how a match starts
+struct engine_setup {
+    int starting_player; //0 or 1. the server's opening switchturn hands the first move to the other player
+    int powermoves; //each, both players get the same
+    int regens;
+    int hp[2];
+};
+
+//xoshiro256** generator state
+struct rng {
+    uint64_t s[4];
+};
+
+/*
+Advances splitmix64 state x and returns its next output. Used to spread seeds, never for game outcomes
+*/
+static inline uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*
+Seeds generator r. The same seed always gives the same sequence
+*/
+static inline void rng_seed(struct rng *r, uint64_t seed) {
+    int i;
+
+    //splitmix64 never produces an all-zero state, which xoshiro can't leave
+    for (i = 0; i < 4; i++) {
+        r->s[i] = splitmix64(&seed);
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+returns the next 64 random bits from r (xoshiro256**)
+*/
+static inline uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/*
+returns a number in [0, n) from random word x. Multiply-shift instead of %, the bias is far below anything n this small can show
+*/
+static inline int engine_below(uint64_t x, int n) {
+    return (int) (((x >> 32) * (uint64_t) n) >> 32);
+}
+
+/*
+returns a random number in [0, n), n > 0
+*/
+static inline int rng_below(struct rng *r, int n) {
+    return engine_below(rng_next(r), n);
+}
+
+/*
+returns a number in [lo, hi] from random word x
+*/
+static inline int engine_roll(uint64_t x, int lo, int hi) {
+    return lo + engine_below(x, hi - lo + 1);
+}
+
+/*
+Rolls how a match starts from draws[ENGINE_SETUP_DRAWS]
+*/
+static inline void engine_setup(const struct engine_rules *rules, const uint64_t *draws, struct engine_setup *s) {
+    s->starting_player = engine_below(draws[0], 2);
+    s->powermoves = engine_roll(draws[1], rules->powermove_count_min, rules->powermove_count_max);
+    s->regens = engine_roll(draws[2], rules->regen_count_min, rules->regen_count_max);
+    s->hp[0] = engine_roll(draws[3], rules->hp_min, rules->hp_max); //not necessarily equal for both players
+    s->hp[1] = engine_roll(draws[4], rules->hp_min, rules->hp_max);
+}
+
+/*
+Plays move for self against opp with random words r1 and r2. A powermove or regen needs one remaining
+returns the damage dealt or hp regenerated, or ENGINE_MISSED for a powermove that missed
+*/
+static inline int engine_move(const struct engine_rules *rules, int move, uint64_t r1, uint64_t r2, struct player_info *self, struct player_info *opp) {
+    int amount;
+
+    if (move == MOVE_POWERMOVE) {
+        self->powermoves_remaining--;
+        if (engine_below(r1, rules->powermove_chance) != 0) {
+            return ENGINE_MISSED;
+        }
+        amount = engine_roll(r2, rules->dmg_min, rules->dmg_max) * rules->powermove_multiplier;
+        opp->hp -= amount;
+    }
+    else if (move == MOVE_REGEN) {
+        self->hp_regens_remaining--;
+        amount = engine_roll(r1, rules->regen_min, rules->regen_max);
+        self->hp += amount;
+    }
+    else {
+        amount = engine_roll(r1, rules->dmg_min, rules->dmg_max);
+        opp->hp -= amount;
+    }
+
+    return amount;
+}
+
+/*
+Draws a match's setup from r
+*/
+static inline void engine_start(const struct engine_rules *rules, struct rng *r, struct engine_setup *s) {
+    uint64_t draws[ENGINE_SETUP_DRAWS];
+    int i;
+
+    for (i = 0; i < ENGINE_SETUP_DRAWS; i++) {
+        draws[i] = rng_next(r);
+    }
+    engine_setup(rules, draws, s);
+}
+
+/*
+Draws from r and plays move for self against opp (see engine_move)
+*/
+static inline int engine_play(const struct engine_rules *rules, struct rng *r, int move, struct player_info *self, struct player_info *opp) {
+    uint64_t r1 = rng_next(r);
+    uint64_t r2 = rng_next(r);
+
+    return engine_move(rules, move, r1, r2, self, opp);
+}
+
+#endif
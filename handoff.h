@@ -0,0 +1,85 @@
+/*
+ * hot restart: the state a running server (--handoff PATH) passes to its replacement (--takeover PATH).
+ *
+ * The old server sends struct handoff_header, then each worker's records, then an HREC_END record, over a unix stream
+ * socket, and hangs up. The listening sockets and client connections travel alongside as SCM_RIGHTS descriptors, at
+ * most HANDOFF_MAX_FDS per message, in the order the records that take them appear. Every record starts with struct
+ * handoff_record. Integers are in the host's byte order, so both servers must run on the same machine (which they do,
+ * sharing the sockets), and a change to any struct here needs a new HANDOFF_MAGIC.
+ *
+ * Clients are referred to by the descriptor they had in the old server, which is unique while it runs.
+*/
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#define HANDOFF_MAGIC "BTLHOFF1"
+#define HANDOFF_MAGIC_LEN 8
+#define HANDOFF_MAX_FDS 250 //descriptors per message, the kernel takes at most 253
+#define HANDOFF_CHUNK_LEN (64 * 1024) //most bytes sent per message
+
+#define HREC_WORKER 1 //struct handoff_worker, starts a worker's records. takes the worker's listening socket
+#define HREC_CLIENT 2 //struct handoff_client, then the name, unhandled input and unsent output. takes the client's socket
+#define HREC_MATCH 3 //struct handoff_match, after the clients playing it
+#define HREC_END 4 //the last record, no payload
+
+//handoff_client flags
+#define HCLIENT_REGISTERED 0x01
+#define HCLIENT_BINARY 0x02
+#define HCLIENT_WAITING 0x04 //in the matchmaking queue. waiting clients come first, in queue order
+#define HCLIENT_BUFFERING 0x08 //reading a line rather than single-byte commands
+#define HCLIENT_DISCARDING 0x10 //skipping the rest of a line that was too long
+#define HCLIENT_WATCH_PROMPT 0x20 //the line being read is the name of a player to watch
+
+struct handoff_header {
+    char magic[HANDOFF_MAGIC_LEN];
+    uint32_t workers; //the new server runs this many workers too, so every client keeps its opponent and matches
+    uint32_t port;
+};
+
+struct handoff_record {
+    uint32_t type; //HREC_*
+    uint32_t len; //payload bytes that follow
+};
+
+struct handoff_worker {
+    uint64_t seed_source; //where the worker's next match seeds come from
+};
+
+struct handoff_client {
+    int32_t id;
+    uint32_t ipaddr; //network byte order
+    uint32_t flags; //HCLIENT_*
+    int32_t rating;
+    uint32_t rated_matches;
+    int32_t last_opponent; //id of the client it may not be matched with right away, or -1
+    int32_t watching; //id of player 0 of the match it watches, or -1
+    uint32_t deadline_ms; //left until its registration or idle deadline, 0 if none is armed
+    uint32_t idle_ms; //since its last input
+    uint32_t name_len;
+    uint32_t in_len;
+    uint32_t out_len;
+    uint64_t waited_ns; //time spent in the matchmaking queue so far
+};
+
+struct handoff_match {
+    int32_t players[2]; //ids
+    uint8_t starting_player; //0 or 1
+    uint8_t active_player;
+    uint8_t speech_state; //1 while the active player is typing a chat line
+    uint8_t pad;
+    int32_t round;
+    int32_t powermove_count; //what each player started with
+    int32_t hp_regen_count;
+    int32_t hp[2];
+    int32_t powermoves_remaining[2];
+    int32_t hp_regens_remaining[2];
+    uint32_t turn_ms; //left on the active player's clock, 0 if it isn't running
+    uint32_t pad2;
+    uint64_t seed;
+    uint64_t rng[4]; //the generator mid-match, so the rest of the match plays out as it would have
+};
+
+#endif
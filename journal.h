@@ -0,0 +1,68 @@
+/*
+ * match journal, written by the server (--journal PATH) and read by journalscan.
+ *
+ * The file is JOURNAL_MAGIC followed by records, and is only ever appended to (several server runs can share one
+ * file). Every record starts with struct journal_record and is padded to a multiple of 8 bytes, so a reader can
+ * mmap the file and cast records in place. Integers are in the host's byte order.
+ *
+ * A match's records share its match_id, which is the match's RNG seed: replaying the journaled moves with it
+ * reproduces the match. Records of matches on different workers interleave, but each match's records are in order.
+*/
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "BTLJRNL1"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_ALIGN 8
+
+#define JREC_START 1 //struct journal_start, then both names
+#define JREC_MOVE 2 //struct journal_move
+#define JREC_CHAT 3 //the text, not null-terminated (the record's padding is zeroed)
+#define JREC_TIMEOUT 4 //the active player ran out of time, no payload
+#define JREC_END 5 //struct journal_end
+
+#define JMOVE_ATTACK 1
+#define JMOVE_POWERMOVE 2
+#define JMOVE_POWERMOVE_MISSED 3
+#define JMOVE_REGEN 4
+
+#define JEND_KO 1
+#define JEND_FORFEIT 2 //the loser ran out of time (--turn-forfeit)
+#define JEND_DROPPED 3 //the loser disconnected
+
+#define JACTOR_NONE 0xff
+
+struct journal_record {
+    uint16_t len; //the whole record: header, payload and padding
+    uint8_t type; //JREC_*
+    uint8_t actor; //0 or 1, the player (in start record order) the record is about, or JACTOR_NONE
+    uint32_t round;
+    uint64_t match_id;
+    uint64_t time_ms; //wall clock, ms since the epoch
+};
+
+struct journal_start {
+    int16_t hp[2];
+    uint8_t powermoves;
+    uint8_t regens;
+    uint8_t starting_player; //0 or 1, who makes the first move
+    uint8_t name_len[2];
+    //followed by both names, not null-terminated
+};
+
+struct journal_move {
+    uint8_t move; //JMOVE_*
+    uint8_t pad;
+    int16_t amount; //damage dealt, or hp regenerated
+    int16_t hp[2]; //both players' hp afterwards
+};
+
+struct journal_end {
+    uint8_t reason; //JEND_*
+    uint8_t winner; //0 or 1
+};
+
+#endif
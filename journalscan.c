@@ -0,0 +1,341 @@
+/*
+ * match journal reader:
+ * maps a journal written by the server (--journal PATH, see journal.h) and scans it in place.
+ * Prints a summary of the whole journal, every finished match of one player (--player), or
+ * every record of one match (--match, or --player with -v).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include "journal.h"
+
+#define TABLE_MIN_SLOTS 1024 //must be a power of two
+
+//a match of interest, found through its start record. start is NULL for empty slots
+struct entry {
+    uint64_t match_id;
+    const struct journal_record *start;
+};
+
+void usage(char *prog);
+const char *playername(const struct journal_record *start, int i, int *len);
+struct entry *lookup(uint64_t match_id);
+void insert(uint64_t match_id, const struct journal_record *start);
+void printrecord(const struct journal_record *r, const struct journal_record *start);
+void printend(const struct journal_record *r, const struct journal_record *start, const char *player);
+
+//settings
+static int have_match = 0;
+static uint64_t match_filter;
+static char *player_filter = NULL;
+static int verbose = 0;
+
+//matches of interest (open addressing, linear probing)
+static struct entry *table = NULL;
+static size_t table_slots = 0;
+static size_t table_count = 0;
+
+//totals
+static unsigned long records, matches_started, moves[5], chats, timeouts, ends[4];
+static unsigned long player_wins, player_losses;
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [--match ID] [--player NAME] [-v] JOURNAL\n", prog);
+    fprintf(stderr, "  --match ID       print every record of match ID (its seed)\n");
+    fprintf(stderr, "  --player NAME    print the result of every match NAME finished\n");
+    fprintf(stderr, "  -v, --verbose    with --player, print every record of those matches too\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    static struct option long_options[] = {
+        {"match", required_argument, NULL, 'm'},
+        {"player", required_argument, NULL, 'p'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "v", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            have_match = 1;
+            match_filter = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            player_filter = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    if (size < JOURNAL_MAGIC_LEN) {
+        fprintf(stderr, "%s is not a match journal\n", argv[optind]);
+        exit(1);
+    }
+
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+
+    if (memcmp(base, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s is not a match journal\n", argv[optind]);
+        exit(1);
+    }
+
+    //one sequential pass, so let the kernel read ahead aggressively
+    madvise((void *) base, size, MADV_SEQUENTIAL);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    const struct journal_record *match_start = NULL; //the start record of the --match match, once seen
+    size_t off = JOURNAL_MAGIC_LEN;
+
+    while (off + sizeof(struct journal_record) <= size) {
+        const struct journal_record *r = (const struct journal_record *) (base + off);
+
+        if (r->len < sizeof(struct journal_record) || r->len % JOURNAL_ALIGN != 0 || off + r->len > size) {
+            fprintf(stderr, "bad record at offset %zu, stopping there\n", off);
+            break;
+        }
+        off += r->len;
+        records++;
+
+        switch (r->type) {
+        case JREC_START:
+            matches_started++;
+            break;
+        case JREC_MOVE:
+            moves[((const struct journal_move *) (r + 1))->move % 5]++;
+            break;
+        case JREC_CHAT:
+            chats++;
+            break;
+        case JREC_TIMEOUT:
+            timeouts++;
+            break;
+        case JREC_END:
+            ends[((const struct journal_end *) (r + 1))->reason % 4]++;
+            break;
+        }
+
+        if (have_match && r->match_id == match_filter) {
+            if (r->type == JREC_START) {
+                match_start = r;
+            }
+            printrecord(r, match_start);
+        }
+
+        if (player_filter) {
+            if (r->type == JREC_START) {
+                int i, len;
+                for (i = 0; i < 2; i++) {
+                    const char *name = playername(r, i, &len);
+                    if ((size_t) len == strlen(player_filter) && memcmp(name, player_filter, len) == 0) {
+                        insert(r->match_id, r);
+                    }
+                }
+            }
+
+            struct entry *e = table_count ? lookup(r->match_id) : NULL;
+            if (e && e->start) {
+                if (verbose) {
+                    printrecord(r, e->start);
+                }
+                if (r->type == JREC_END) {
+                    printend(r, e->start, player_filter);
+                }
+            }
+        }
+    }
+
+    if (off != size && off + sizeof(struct journal_record) > size) {
+        fprintf(stderr, "%zu bytes of an unfinished record at the end\n", size - off);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    if (player_filter) {
+        printf("%s: %lu wins, %lu losses\n", player_filter, player_wins, player_losses);
+    }
+    if (player_filter || have_match) {
+        return 0;
+    }
+
+    printf("records %lu (%zu bytes), scanned in %.3fs (%.0f records/s)\n", records, size, secs, secs > 0 ? records / secs : 0);
+    printf("matches started %lu, ended %lu (knockout %lu, forfeit %lu, disconnect %lu)\n",
+           matches_started, ends[JEND_KO] + ends[JEND_FORFEIT] + ends[JEND_DROPPED], ends[JEND_KO], ends[JEND_FORFEIT], ends[JEND_DROPPED]);
+    printf("moves: attack %lu, powermove %lu, missed powermove %lu, regen %lu\n",
+           moves[JMOVE_ATTACK], moves[JMOVE_POWERMOVE], moves[JMOVE_POWERMOVE_MISSED], moves[JMOVE_REGEN]);
+    printf("chat lines %lu, turn timeouts %lu\n", chats, timeouts);
+
+    return 0;
+}
+
+/*
+returns player i's name from start record start (not null-terminated), and its length in len
+*/
+const char *playername(const struct journal_record *start, int i, int *len) {
+    const struct journal_start *js = (const struct journal_start *) (start + 1);
+    const char *names = (const char *) (js + 1);
+
+    *len = js->name_len[i];
+    return i == 0 ? names : names + js->name_len[0];
+}
+
+/*
+returns the slot for match_id: its entry, or the empty slot it would go in
+*/
+struct entry *lookup(uint64_t match_id) {
+    size_t i = (match_id * 0x9e3779b97f4a7c15ULL) >> 20 & (table_slots - 1);
+
+    while (table[i].start && table[i].match_id != match_id) {
+        i = (i + 1) & (table_slots - 1);
+    }
+    return &table[i];
+}
+
+void insert(uint64_t match_id, const struct journal_record *start) {
+    //grow at half full
+    if ((table_count + 1) * 2 > table_slots) {
+        struct entry *old = table;
+        size_t old_slots = table_slots, i;
+
+        table_slots = table_slots ? table_slots * 2 : TABLE_MIN_SLOTS;
+        if (!(table = calloc(table_slots, sizeof(struct entry)))) {
+            perror("calloc");
+            exit(1);
+        }
+        for (i = 0; i < old_slots; i++) {
+            if (old[i].start) {
+                *lookup(old[i].match_id) = old[i];
+            }
+        }
+        free(old);
+    }
+
+    struct entry *e = lookup(match_id);
+    if (!e->start) {
+        table_count++;
+    }
+    e->match_id = match_id;
+    e->start = start;
+}
+
+void printrecord(const struct journal_record *r, const struct journal_record *start) {
+    char when[32];
+    time_t secs = r->time_ms / 1000;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+
+    //who the record is about, once the match's start record is known
+    char actor[64] = "?";
+    if (start && r->actor != JACTOR_NONE) {
+        int len;
+        const char *name = playername(start, r->actor & 1, &len);
+        snprintf(actor, sizeof(actor), "%.*s", len, name);
+    }
+
+    printf("%s.%03u %llu round %u: ", when, (unsigned) (r->time_ms % 1000), (unsigned long long) r->match_id, r->round);
+
+    switch (r->type) {
+    case JREC_START: {
+        const struct journal_start *js = (const struct journal_start *) (r + 1);
+        int len0, len1;
+        const char *name0 = playername(r, 0, &len0);
+        const char *name1 = playername(r, 1, &len1);
+        printf("%.*s (%d hp) vs %.*s (%d hp), %u powermoves, %u regens, %.*s starts\n",
+               len0, name0, js->hp[0], len1, name1, js->hp[1], js->powermoves, js->regens,
+               js->starting_player ? len1 : len0, js->starting_player ? name1 : name0);
+        break;
+    }
+    case JREC_MOVE: {
+        const struct journal_move *jm = (const struct journal_move *) (r + 1);
+        static const char *kinds[] = {"?", "attacks", "powermoves", "misses a powermove", "regenerates"};
+        printf("%s %s", actor, kinds[jm->move % 5]);
+        if (jm->move != JMOVE_POWERMOVE_MISSED) {
+            printf(" (%d)", jm->amount);
+        }
+        printf(", hp %d/%d\n", jm->hp[0], jm->hp[1]);
+        break;
+    }
+    case JREC_CHAT: {
+        //the text runs up to the record's zeroed padding
+        const char *text = (const char *) (r + 1);
+        int len = strnlen(text, r->len - sizeof(*r));
+        printf("%s says \"%.*s\"\n", actor, len, text);
+        break;
+    }
+    case JREC_TIMEOUT:
+        printf("%s ran out of time\n", actor);
+        break;
+    case JREC_END: {
+        const struct journal_end *je = (const struct journal_end *) (r + 1);
+        static const char *reasons[] = {"?", "knockout", "forfeit", "disconnect"};
+        char winner[64] = "?";
+        if (start) {
+            int len;
+            const char *name = playername(start, je->winner & 1, &len);
+            snprintf(winner, sizeof(winner), "%.*s", len, name);
+        }
+        printf("%s wins (%s)\n", winner, reasons[je->reason % 4]);
+        break;
+    }
+    default:
+        printf("unknown record type %u\n", r->type);
+    }
+}
+
+/*
+Prints one line about how a match of player ended, from its end record r
+*/
+void printend(const struct journal_record *r, const struct journal_record *start, const char *player) {
+    const struct journal_end *je = (const struct journal_end *) (r + 1);
+    static const char *reasons[] = {"?", "knockout", "forfeit", "disconnect"};
+    int len, me;
+
+    const char *name = playername(start, 0, &len);
+    me = !((size_t) len == strlen(player) && memcmp(name, player, len) == 0);
+    const char *opp = playername(start, !me, &len);
+
+    int won = je->winner == me;
+    if (won) {
+        player_wins++;
+    }
+    else {
+        player_losses++;
+    }
+
+    printf("%llu: %s against %.*s after %u rounds (%s)\n", (unsigned long long) r->match_id, won ? "won" : "lost",
+           len, opp, r->round, reasons[je->reason % 4]);
+}
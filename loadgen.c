@@ -0,0 +1,812 @@
+/*
+ * load generator for the battle server:
+ * opens N connections to a running server, registers a unique name on each,
+ * and has every connection play matches with the a/p/r/s commands until the
+ * run is over. Prints connect latency, time-to-match, per-move round trip
+ * latency percentiles and move throughput at the end. With --binary the bots
+ * use the binary protocol (see protocol.h) instead of parsing the text.
+ *
+ * Linux only (epoll).
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "protocol.h"
+
+#ifndef PORT
+    #define PORT 30100
+#endif
+
+#define MAX_EVENTS 256
+#define READ_LEN 4096
+#define LINE_LEN 1024 //longest server line kept whole (longer lines are scanned in pieces), and longest frame
+#define NAME_LEN 48
+
+//what a bot is doing right now
+enum {
+    BOT_CONNECTING,
+    BOT_NAMING, //name sent, waiting for the server to accept it
+    BOT_WAITING, //registered, waiting for an opponent
+    BOT_PLAYING,
+    BOT_DEAD
+};
+
+struct bot {
+    int id;
+    int fd;
+    int state;
+    char name[NAME_LEN];
+    int name_tries;
+
+    char line[LINE_LEN]; //partial line (or with --binary, frame) received so far
+    int line_len;
+    int welcomed; //with --binary: 1 once the text welcome line has been skipped
+
+    //what the last menu offered
+    int can_powermove;
+    int can_regen;
+
+    long long connect_start; //microseconds, see nowus()
+    long long wait_start; //when the bot started waiting for an opponent
+    long long move_sent; //when the move in flight was sent, 0 if none
+    int speaking; //1 between sending 's' and sending the chat line
+
+    unsigned int action_gen; //bumped to cancel a scheduled move
+};
+
+//a scheduled move, ordered by due time in the timer heap
+struct timer {
+    long long due;
+    struct bot *bot;
+    unsigned int gen; //stale unless it equals bot->action_gen
+};
+
+//growable array of latency samples, in microseconds
+struct samples {
+    long long *v;
+    size_t n;
+    size_t cap;
+};
+
+void usage(char *prog);
+long long nowus();
+void startconnect(struct bot *b);
+void handleconnected(struct bot *b);
+void handleread(struct bot *b);
+void handleline(struct bot *b, char *line);
+void handleprompt(struct bot *b, char *partial);
+void handleframe(struct bot *b, unsigned char *frame, int len);
+void sendname(struct bot *b);
+void startwaiting(struct bot *b);
+void startmatch(struct bot *b);
+void myturn(struct bot *b);
+void domove(struct bot *b);
+void sendline(struct bot *b, const char *s);
+void sendbytes(struct bot *b, const void *s, size_t len);
+void sendframe(struct bot *b, int type, const void *payload, size_t len);
+void movedone(struct bot *b);
+void killbot(struct bot *b, const char *why);
+void schedulemove(struct bot *b, long long delay_us);
+void timer_push(struct timer t);
+struct timer timer_pop();
+void addsample(struct samples *s, long long us);
+void printsamples(const char *label, struct samples *s);
+int cmpll(const void *a, const void *b);
+
+//settings
+static char *host = "127.0.0.1";
+static int port = PORT;
+static int bot_count = 100;
+static int duration = 10; //seconds
+static int think_ms = 0; //mean think time before each move
+static double chat_rate = 0.1; //chance that a turn starts with a chat line
+static int connect_rate = 500; //new connections per second, 0 to open them all at once
+static int binary = 0; //1 to use the binary protocol
+
+static struct sockaddr_in server_addr;
+static int epfd;
+static struct bot *bots;
+
+static struct timer *heap;
+static size_t heap_len, heap_cap;
+
+//results
+static struct samples connect_lat, match_wait, move_rtt, chat_rtt;
+static unsigned long moves, chats, matches_won, matches_lost, matches_dropped, out_of_turn, disconnects;
+
+void usage(char *prog) {
+    fprintf(stderr, "Usage: %s [-c N] [--host ADDR] [--port PORT] [--duration SECONDS] [--think-ms MS] [--chat-rate P] [--connect-rate N] [--binary]\n", prog);
+    fprintf(stderr, "  -c, --clients N       connections to open (default %d)\n", bot_count);
+    fprintf(stderr, "  --host ADDR           server address (default %s)\n", host);
+    fprintf(stderr, "  --port PORT           server port (default %d)\n", PORT);
+    fprintf(stderr, "  --duration SECONDS    how long to run (default %d)\n", duration);
+    fprintf(stderr, "  --think-ms MS         mean think time before each move, uniformly 0..2*MS (default %d)\n", think_ms);
+    fprintf(stderr, "  --chat-rate P         chance (0..1) that a turn starts with a chat line (default %.2f)\n", chat_rate);
+    fprintf(stderr, "  --connect-rate N      new connections per second, 0 for all at once (default %d)\n", connect_rate);
+    fprintf(stderr, "  --binary              use the binary protocol (chat round trips are not measured then)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt;
+
+    static struct option long_options[] = {
+        {"clients", required_argument, NULL, 'c'},
+        {"host", required_argument, NULL, 'h'},
+        {"port", required_argument, NULL, 'p'},
+        {"duration", required_argument, NULL, 'd'},
+        {"think-ms", required_argument, NULL, 't'},
+        {"chat-rate", required_argument, NULL, 'r'},
+        {"connect-rate", required_argument, NULL, 'C'},
+        {"binary", no_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "c:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            bot_count = atoi(optarg);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 't':
+            think_ms = atoi(optarg);
+            break;
+        case 'r':
+            chat_rate = atof(optarg);
+            break;
+        case 'C':
+            connect_rate = atoi(optarg);
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (bot_count < 1 || duration < 1 || think_ms < 0 || connect_rate < 0 || chat_rate < 0 || chat_rate > 1) {
+        usage(argv[0]);
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        exit(1);
+    }
+
+    //one fd per bot, plus a few to spare
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t) bot_count + 16) {
+        rl.rlim_cur = (rlim_t) bot_count + 16 < rl.rlim_max ? (rlim_t) bot_count + 16 : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(0) ^ getpid());
+
+    epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    bots = calloc(bot_count, sizeof(struct bot));
+    if (!bots) {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (i = 0; i < bot_count; i++) {
+        bots[i].id = i;
+        bots[i].fd = -1;
+        bots[i].state = BOT_CONNECTING;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long long start = nowus();
+    long long end = start + duration * 1000000LL;
+    long long next_report = start + 1000000;
+    unsigned long last_moves = 0;
+    int started = 0;
+
+    while (1) {
+        long long now = nowus();
+        if (now >= end) {
+            break;
+        }
+
+        //ramp up at connect_rate connections per second
+        int target = connect_rate == 0 ? bot_count : (int) ((now - start) * connect_rate / 1000000) + 1;
+        while (started < bot_count && started < target) {
+            startconnect(&bots[started++]);
+        }
+
+        //run the moves that are due
+        while (heap_len > 0 && heap[0].due <= now) {
+            struct timer t = timer_pop();
+            if (t.gen == t.bot->action_gen && t.bot->state == BOT_PLAYING) {
+                domove(t.bot);
+            }
+        }
+
+        if (now >= next_report) {
+            printf("%3llds: %d clients started, %lu moves/s\n", (now - start) / 1000000, started, moves - last_moves);
+            fflush(stdout);
+            last_moves = moves;
+            next_report += 1000000;
+        }
+
+        //sleep until the next move, connection or report is due
+        long long wake = next_report < end ? next_report : end;
+        if (heap_len > 0 && heap[0].due < wake) {
+            wake = heap[0].due;
+        }
+        if (started < bot_count && connect_rate > 0) {
+            long long next_connect = start + (long long) started * 1000000 / connect_rate;
+            if (next_connect < wake) {
+                wake = next_connect;
+            }
+        }
+        int timeout_ms = wake > now ? (int) ((wake - now + 999) / 1000) : 0;
+
+        int nready = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (i = 0; i < nready; i++) {
+            struct bot *b = events[i].data.ptr;
+
+            if (b->state == BOT_DEAD) {
+                continue;
+            }
+            else if (b->state == BOT_CONNECTING) {
+                handleconnected(b);
+            }
+            else {
+                handleread(b);
+            }
+        }
+    }
+
+    double elapsed = (nowus() - start) / 1e6;
+
+    for (i = 0; i < bot_count; i++) {
+        if (bots[i].fd != -1) {
+            close(bots[i].fd);
+        }
+    }
+
+    printf("\n%d %s clients, %.1fs, think %dms, chat rate %.2f\n", bot_count, binary ? "binary" : "text", elapsed, think_ms, chat_rate);
+    printsamples("connect", &connect_lat);
+    printsamples("time to match", &match_wait);
+    printsamples("move rtt", &move_rtt);
+    printsamples("chat rtt", &chat_rtt);
+    printf("moves %lu (%.1f/s), chats %lu\n", moves, moves / elapsed, chats);
+    printf("matches won %lu, lost %lu, opponent dropped %lu\n", matches_won, matches_lost, matches_dropped);
+    printf("out of turn %lu, disconnects %lu\n", out_of_turn, disconnects);
+
+    return 0;
+}
+
+/*
+Returns a monotonic timestamp in microseconds
+*/
+long long nowus() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+Starts a non-blocking connect for bot b. Completion shows up as the socket becoming writable
+*/
+void startconnect(struct bot *b) {
+    b->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (b->fd == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    int flags = fcntl(b->fd, F_GETFL, 0);
+    fcntl(b->fd, F_SETFL, flags | O_NONBLOCK);
+
+    //moves are single bytes, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    b->connect_start = nowus();
+    if (connect(b->fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
+        killbot(b, strerror(errno));
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = b;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/*
+Finishes bot b's connect, and switches it to reading
+*/
+void handleconnected(struct bot *b) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(b->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        killbot(b, strerror(err ? err : errno));
+        return;
+    }
+
+    addsample(&connect_lat, nowus() - b->connect_start);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = b;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, b->fd, &ev);
+
+    //names only need to be unique against other load generators, so the pid goes in them
+    snprintf(b->name, sizeof(b->name), "lg%d_%d", (int) getpid(), b->id);
+    b->state = BOT_NAMING;
+
+    //the server reads this where it expects the name, so it can go out before the welcome line arrives
+    if (binary) {
+        sendline(b, BINARY_HELLO "\n");
+    }
+}
+
+/*
+Reads what the server sent bot b, and reacts to it one line at a time
+*/
+void handleread(struct bot *b) {
+    char buf[READ_LEN];
+    ssize_t n = read(b->fd, buf, sizeof(buf));
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+        killbot(b, n == 0 ? "server closed the connection" : strerror(errno));
+        return;
+    }
+
+    ssize_t i;
+
+    if (binary) {
+        for (i = 0; i < n && b->state != BOT_DEAD; i++) {
+            //everything up to the end of the welcome line is text
+            if (!b->welcomed) {
+                b->welcomed = (buf[i] == '\n');
+                continue;
+            }
+
+            b->line[b->line_len++] = buf[i];
+            if (b->line_len < 2) {
+                continue;
+            }
+
+            int len = ((unsigned char) b->line[0] << 8) | (unsigned char) b->line[1];
+            if (len == 0 || 2 + len > LINE_LEN - 1) {
+                killbot(b, "bad frame");
+                return;
+            }
+            if (b->line_len == 2 + len) {
+                b->line[b->line_len] = '\0';
+                b->line_len = 0;
+                handleframe(b, (unsigned char *) b->line + 2, len);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < n && b->state != BOT_DEAD; i++) {
+        b->line[b->line_len++] = buf[i];
+
+        if (buf[i] == '\n' || b->line_len == LINE_LEN - 1) {
+            b->line[b->line_len] = '\0';
+            b->line_len = 0;
+            handleline(b, b->line);
+        }
+    }
+
+    //prompts that don't end in a newline
+    if (b->state != BOT_DEAD && b->line_len > 0) {
+        b->line[b->line_len] = '\0';
+        handleprompt(b, b->line);
+    }
+}
+
+/*
+Reacts to a complete line from the server
+*/
+void handleline(struct bot *b, char *line) {
+    if (strstr(line, "Please enter your name") || strstr(line, "Please type another name")) {
+        sendname(b);
+        return;
+    }
+
+    if (strstr(line, "Awaiting opponent...") || strstr(line, "Awaiting next opponent...")) {
+        startwaiting(b);
+    }
+    else if (strncmp(line, "You engage ", 11) == 0) {
+        startmatch(b);
+    }
+    else if (b->state != BOT_PLAYING) {
+        return;
+    }
+    else if (strncmp(line, "You hit ", 8) == 0 || strncmp(line, "You powermove ", 14) == 0 ||
+             strncmp(line, "You missed your powermove", 25) == 0 || strncmp(line, "You regenerated ", 16) == 0) {
+        movedone(b);
+    }
+    else if (strstr(line, "You win!")) {
+        if (strstr(line, "Opponent dropped")) {
+            matches_dropped++;
+        }
+        else {
+            matches_won++;
+        }
+    }
+    else if (strstr(line, "You lose!")) {
+        matches_lost++;
+    }
+    else if (strncmp(line, "(a)ttack", 8) == 0) {
+        b->can_powermove = 0;
+        b->can_regen = 0;
+    }
+    else if (strncmp(line, "(p)owermove", 11) == 0) {
+        b->can_powermove = 1;
+    }
+    else if (strncmp(line, "(r)egenerate", 12) == 0) {
+        b->can_regen = 1;
+    }
+    else if (strncmp(line, "(s)peak something", 17) == 0) {
+        //the menu is always the last thing sent before it is our turn
+        myturn(b);
+    }
+    else if (strstr(line, "Wait your turn...")) {
+        out_of_turn++;
+    }
+}
+
+/*
+Reacts to a frame from the server (--binary). frame is the type byte and len - 1 bytes of payload
+*/
+void handleframe(struct bot *b, unsigned char *frame, int len) {
+    unsigned char *payload = frame + 1;
+
+    switch (frame[0]) {
+    case MSG_HELLO:
+    case MSG_NAME_REJECTED:
+        sendname(b);
+        break;
+    case MSG_WAITING:
+        startwaiting(b);
+        break;
+    case MSG_MATCH_START:
+        startmatch(b);
+        break;
+    case MSG_STATE:
+        if (b->state == BOT_PLAYING && len == 1 + STATE_PAYLOAD_LEN) {
+            b->can_powermove = payload[2] > 0;
+            b->can_regen = payload[3] > 0;
+            if (payload[8]) {
+                myturn(b);
+            }
+        }
+        break;
+    case MSG_EVENT:
+        if (b->state == BOT_PLAYING && len == 5 && payload[1] == 0) {
+            movedone(b);
+        }
+        break;
+    case MSG_MATCH_END:
+        if (len == 2) {
+            if (payload[0] == RESULT_WIN) {
+                matches_won++;
+            }
+            else if (payload[0] == RESULT_LOSS) {
+                matches_lost++;
+            }
+            else {
+                matches_dropped++;
+            }
+        }
+        break;
+    case MSG_TEXT:
+        if (strstr((char *) payload, "Wait your turn...")) {
+            out_of_turn++;
+        }
+        break;
+    }
+}
+
+/*
+Sends bot b's name, or a variation of it if the last one was rejected
+*/
+void sendname(struct bot *b) {
+    if (b->name_tries++ > 0) {
+        //taken by someone else, try a variation
+        snprintf(b->name, sizeof(b->name), "lg%d_%d_%d", (int) getpid(), b->id, b->name_tries);
+    }
+
+    if (binary) {
+        sendframe(b, CMD_NAME, b->name, strlen(b->name));
+        return;
+    }
+
+    char s[NAME_LEN + 1];
+    snprintf(s, sizeof(s), "%s\n", b->name);
+    sendline(b, s);
+}
+
+/*
+Bot b is (back) in the matchmaking queue
+*/
+void startwaiting(struct bot *b) {
+    //whatever was scheduled belongs to the match that just ended
+    b->action_gen++;
+    b->move_sent = 0;
+    b->speaking = 0;
+    b->state = BOT_WAITING;
+    b->wait_start = nowus();
+}
+
+/*
+Bot b got an opponent
+*/
+void startmatch(struct bot *b) {
+    addsample(&match_wait, nowus() - b->wait_start);
+    b->state = BOT_PLAYING;
+    b->speaking = 0;
+    b->move_sent = 0;
+}
+
+/*
+Reacts to the incomplete line at the end of what the server sent
+*/
+void handleprompt(struct bot *b, char *partial) {
+    if (b->state == BOT_PLAYING && b->speaking && strcmp(partial, "Speak: ") == 0) {
+        addsample(&chat_rtt, nowus() - b->move_sent);
+        b->move_sent = 0;
+        b->line_len = 0;
+
+        char s[64];
+        snprintf(s, sizeof(s), "gg from %s\n", b->name);
+        sendline(b, s);
+        chats++;
+        b->speaking = 0;
+
+        //the server doesn't send anything back for chat, and it is still our turn
+        schedulemove(b, 0);
+    }
+}
+
+/*
+It is bot b's turn: make a move after thinking about it
+*/
+void myturn(struct bot *b) {
+    long long delay = think_ms > 0 ? (long long) (rand() % (2 * think_ms * 1000 + 1)) : 0;
+    schedulemove(b, delay);
+}
+
+/*
+Sends bot b's move: sometimes chat first, otherwise a random one of the moves the menu offered
+*/
+void domove(struct bot *b) {
+    char cmd = 'a';
+    int roll = rand() % 100;
+
+    if (!b->speaking && rand() < chat_rate * ((double) RAND_MAX + 1)) {
+        cmd = 's';
+        b->speaking = 1;
+    }
+    else if (b->can_powermove && roll < 30) {
+        cmd = 'p';
+    }
+    else if (b->can_regen && roll >= 80) {
+        cmd = 'r';
+    }
+
+    if (binary) {
+        if (cmd == 's') {
+            //chat is a frame of its own, which the server doesn't answer. it is still our turn afterwards
+            char s[64];
+            snprintf(s, sizeof(s), "gg from %s", b->name);
+            sendframe(b, CMD_CHAT, s, strlen(s));
+            chats++;
+            schedulemove(b, 0);
+            return;
+        }
+
+        b->speaking = 0;
+        b->move_sent = nowus();
+        sendframe(b, CMD_MOVE, &cmd, 1);
+        return;
+    }
+
+    char s[2] = {cmd, '\0'};
+    b->move_sent = nowus();
+    sendline(b, s);
+}
+
+/*
+Sends s to the server on behalf of bot b
+*/
+void sendline(struct bot *b, const char *s) {
+    sendbytes(b, s, strlen(s));
+}
+
+void sendbytes(struct bot *b, const void *s, size_t len) {
+    //everything a bot sends is tiny, so a short write means the server stopped reading
+    if (write(b->fd, s, len) != (ssize_t) len) {
+        killbot(b, "short write");
+    }
+}
+
+/*
+Sends a binary protocol frame to the server on behalf of bot b
+*/
+void sendframe(struct bot *b, int type, const void *payload, size_t len) {
+    unsigned char frame[FRAME_HEADER_LEN + 128];
+
+    frame[0] = (len + 1) >> 8;
+    frame[1] = (len + 1) & 0xff;
+    frame[2] = type;
+    memcpy(frame + FRAME_HEADER_LEN, payload, len);
+    sendbytes(b, frame, FRAME_HEADER_LEN + len);
+}
+
+/*
+Bot b's move was answered
+*/
+void movedone(struct bot *b) {
+    if (b->move_sent) {
+        addsample(&move_rtt, nowus() - b->move_sent);
+        b->move_sent = 0;
+        moves++;
+    }
+}
+
+/*
+Drops bot b for the rest of the run
+*/
+void killbot(struct bot *b, const char *why) {
+    fprintf(stderr, "bot %d: %s\n", b->id, why);
+
+    if (b->fd != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, b->fd, NULL);
+        close(b->fd);
+        b->fd = -1;
+    }
+
+    b->state = BOT_DEAD;
+    b->action_gen++;
+    disconnects++;
+}
+
+/*
+Schedules bot b's next move delay_us from now, replacing any move already scheduled
+*/
+void schedulemove(struct bot *b, long long delay_us) {
+    struct timer t;
+    t.due = nowus() + delay_us;
+    t.bot = b;
+    t.gen = ++b->action_gen;
+    timer_push(t);
+}
+
+/*
+Adds t to the timer heap
+*/
+void timer_push(struct timer t) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 256;
+        heap = realloc(heap, heap_cap * sizeof(struct timer));
+        if (!heap) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    size_t i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].due > t.due) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = t;
+}
+
+/*
+Removes and returns the earliest timer. The heap must not be empty
+*/
+struct timer timer_pop() {
+    struct timer top = heap[0];
+    struct timer last = heap[--heap_len];
+    size_t i = 0;
+
+    while (2 * i + 1 < heap_len) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < heap_len && heap[child + 1].due < heap[child].due) {
+            child++;
+        }
+        if (last.due <= heap[child].due) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_len > 0) {
+        heap[i] = last;
+    }
+
+    return top;
+}
+
+void addsample(struct samples *s, long long us) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->v = realloc(s->v, s->cap * sizeof(long long));
+        if (!s->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = us;
+}
+
+int cmpll(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+Prints the sample count and p50/p99/p999/max of s, in milliseconds
+*/
+void printsamples(const char *label, struct samples *s) {
+    if (s->n == 0) {
+        printf("%-14s n=0\n", label);
+        return;
+    }
+
+    qsort(s->v, s->n, sizeof(long long), cmpll);
+
+    //nearest-rank percentiles
+    size_t p50 = (s->n * 500 + 999) / 1000;
+    size_t p99 = (s->n * 990 + 999) / 1000;
+    size_t p999 = (s->n * 999 + 999) / 1000;
+
+    printf("%-14s n=%-8lu p50 %8.3fms  p99 %8.3fms  p999 %8.3fms  max %8.3fms\n", label, (unsigned long) s->n,
+           s->v[p50 - 1] / 1000.0, s->v[p99 - 1] / 1000.0, s->v[p999 - 1] / 1000.0, s->v[s->n - 1] / 1000.0);
+}
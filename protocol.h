@@ -0,0 +1,65 @@
+/*
+ * binary protocol, for bots and other automated clients.
+ *
+ * Every connection starts in the text protocol. Right after the welcome line, a client may send
+ * BINARY_HELLO instead of its name. The server answers with MSG_HELLO, and from then on both sides
+ * only send frames:
+ *
+ *   u16 length (big-endian, counts the type byte and the payload), u8 type, payload
+ *
+ * Integers in payloads are big-endian, hitpoints are signed (they can drop below zero).
+ * The welcome line is always sent before MSG_HELLO, so a client skips everything up to and
+ * including the first '\n' before reading frames.
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#define BINARY_HELLO "\x1b" "BIN1" //handshake line, sent (with a '\n') in place of a name
+#define BINARY_VERSION 1
+#define FRAME_HEADER_LEN 3
+
+//server to client
+#define MSG_HELLO 1 //u8 version
+#define MSG_TEXT 2 //text that has no frame of its own (arena announcements, notices)
+#define MSG_NAME_REJECTED 3 //u8 reason, see NAME_*
+#define MSG_WAITING 4 //registered, or back in the queue after a match: waiting for an opponent
+#define MSG_MATCH_START 5 //opponent's name
+#define MSG_STATE 6 //i16 hp, u8 powermoves, u8 hp regens, i16 opponent hp, u16 round, u8 1 if it is your turn
+#define MSG_EVENT 7 //u8 event (EVENT_*), u8 0 if you did it and 1 if your opponent did, i16 amount
+#define MSG_CHAT 8 //u8 name length, name, text
+#define MSG_MATCH_END 9 //u8 result, see RESULT_*
+
+//to spectators (see CMD_WATCH). players are numbered 0 and 1, in MSG_WATCH_START order. chat comes as MSG_CHAT
+#define MSG_WATCH_START 10 //u8 length of player 0's name, player 0's name, player 1's name
+#define MSG_WATCH_STATE 11 //i16 player 0's hp, i16 player 1's hp, u16 round, u8 whose turn it is
+#define MSG_WATCH_EVENT 12 //u8 event (EVENT_*), u8 who did it, i16 amount
+#define MSG_WATCH_END 13 //u8 the winner, u8 how (END_*). the spectator is waiting for an opponent again
+
+#define NAME_TOO_LONG 1
+#define NAME_EMPTY 2
+#define NAME_TAKEN 3
+
+#define EVENT_HIT 1
+#define EVENT_POWERMOVE 2
+#define EVENT_POWERMOVE_MISSED 3
+#define EVENT_REGEN 4
+
+#define RESULT_LOSS 0
+#define RESULT_WIN 1
+#define RESULT_OPPONENT_DROPPED 2
+
+#define END_KO 1
+#define END_FORFEIT 2 //the loser ran out of time
+#define END_DROPPED 3 //the loser disconnected
+
+#define STATE_PAYLOAD_LEN 9
+#define WATCH_STATE_PAYLOAD_LEN 7
+
+//client to server
+#define CMD_NAME 1 //the name to register
+#define CMD_MOVE 2 //u8 'a', 'p' or 'r'
+#define CMD_CHAT 3 //text to say to the opponent, only on your turn
+#define CMD_WATCH 4 //a player's name, to spectate their match instead of waiting for an opponent. empty to stop watching
+
+#endif